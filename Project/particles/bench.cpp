@@ -0,0 +1,188 @@
+/*Microbenchmarks for the particle kernels.
+
+	Times apply_force, go_through_neighbors, init_bins, insert_into_bins,
+	move_and_update and move_particles in isolation, instead of through
+	a whole 1000-step simulation. The particles are the usual seeded
+	grid layout, but the box is sized so that every bin holds -occ
+	particles on average. At the density of the simulations a bin holds
+	about one particle and its neighbors almost none, so the force
+	kernels would mostly test particles against themselves; the default
+	of 2 per bin gives them real neighbor pairs. Every kernel gets -w
+	untimed warmup runs and -r timed runs. Each run starts from the same
+	copy of the particles and bins, and the report gives
+	min/median/mean/stddev per item:
+	 - per pair for the force kernels (pairs tested, not pairs within cutoff)
+	 - per particle for rebinning and moving
+	 - per bin for init_bins
+
+To run in Linux:
+make -f Makefile_p bench
+./bench -n 100000 -occ 2
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include "common.h"
+
+extern double size, bin_size;
+extern int num_bins, num_rows, bin_stride;
+int *globalIds;
+
+int warmup, reps;
+double *samples;
+
+/* print the statistics of the timed runs of a kernel, in ns per item */
+void report( const char *kernel, long long items )
+{
+    std::sort( samples, samples + reps );
+    double mean = 0, var = 0;
+    for( int r = 0; r < reps; r++ )
+        mean += samples[r] / reps;
+    for( int r = 0; r < reps; r++ )
+        var += (samples[r] - mean) * (samples[r] - mean) / (reps > 1 ? reps - 1 : 1);
+
+    double scale = 1e9 / items;
+    printf( "%-22s %12lld %10.2f %10.2f %10.2f %10.2f\n", kernel, items,
+        samples[0] * scale, samples[reps / 2] * scale, mean * scale, sqrt( var ) * scale );
+}
+
+/* run setup (untimed) and kernel (timed) warmup+reps times */
+#define BENCH( kernel, items, setup, body )                        \
+    for( int r = -warmup; r < reps; r++ )                          \
+    {                                                              \
+        setup;                                                     \
+        double t = read_timer( );                                  \
+        body;                                                      \
+        t = read_timer( ) - t;                                     \
+        if( r >= 0 )                                               \
+            samples[r] = t;                                        \
+    }                                                              \
+    report( kernel, items );
+
+void free_bins( bin_t *bins )
+{
+    for( int i = 0; i < num_bins; i++ )
+        sim_free( bins[i].particle_ids );
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set number of particles\n" );
+        printf( "-s <int> to set the random seed (default: 1)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-occ <float> to set the mean number of particles per bin (default: 2)\n" );
+        printf( "-w <int> to set the number of warmup runs (default: 2)\n" );
+        printf( "-r <int> to set the number of timed runs (default: 10)\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 100000 );
+    int seed = read_int( argc, argv, "-s", 1 );
+    int k = read_int( argc, argv, "-k", 1 );
+    char *occ = read_string( argc, argv, "-occ", NULL );
+    double occupancy = occ ? atof( occ ) : 2;
+    warmup = read_int( argc, argv, "-w", 2 );
+    reps = max( read_int( argc, argv, "-r", 10 ), 1 );
+
+    /* a square of n/occ bins */
+    set_size( n, k );
+    set_rows( max( (int)ceil( sqrt( n / occupancy ) ), 1 ) );
+    size = num_rows * bin_size;
+
+    samples = (double*) malloc( reps * sizeof(double) );
+    particle_t *initial = (particle_t*) malloc( n * sizeof(particle_t) );
+    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
+    globalIds = (int*) malloc( n * sizeof(int) );
+    init_particles( n, initial, seed );
+    for( int i = 0; i < n; i++ )
+        globalIds[i] = bin_of( initial[i] );
+    memcpy( particles, initial, n * sizeof(particle_t) );
+
+    bin_t *bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+    init_bins( bins );
+    insert_into_bins( particles, bins, n );
+
+    /* pairs tested by go_through_neighbors, with the pair lists it would walk;
+       the empty bins, the padding among them, are skipped */
+    int stencil = (2 * k + 1) * (2 * k + 1);
+    long long pairs = 0;
+    for( int i = 0; i < num_bins; i++ )
+        for( int j = 0; j < stencil && bins[i].num_particles; j++ )
+            pairs += (long long)bins[i].num_particles * bins[i + (j % (2*k+1) - k) * bin_stride + j / (2*k+1) - k].num_particles;
+
+    int *pair_i = (int*) malloc( pairs * sizeof(int) );
+    int *pair_j = (int*) malloc( pairs * sizeof(int) );
+    long long p = 0;
+    for( int i = 0; i < num_bins; i++ )
+        for( int j = 0; j < stencil && bins[i].num_particles; j++ )
+        {
+            bin_t &neighbor = bins[i + (j % (2*k+1) - k) * bin_stride + j / (2*k+1) - k];
+            for( int a = 0; a < bins[i].num_particles; a++ )
+                for( int b = 0; b < neighbor.num_particles; b++, p++ )
+                {
+                    pair_i[p] = bins[i].particle_ids[a];
+                    pair_j[p] = neighbor.particle_ids[b];
+                }
+        }
+
+    printf( "n = %d, k = %d, bins = %d, particles per bin = %.2f, pairs tested = %lld\n",
+        n, k, num_rows * num_rows, (double)n / (num_rows * num_rows), pairs );
+    if( pairs < 2LL * n )
+        printf( "warning: the pairs tested are mostly particles with themselves, raise -occ to time the force kernels\n" );
+    printf( "%d warmup and %d timed runs, times in ns per item\n", warmup, reps );
+    printf( "%-22s %12s %10s %10s %10s %10s\n", "kernel", "items", "min", "median", "mean", "stddev" );
+
+    BENCH( "apply_force", pairs,
+        memcpy( particles, initial, n * sizeof(particle_t) ),
+        for( long long q = 0; q < pairs; q++ )
+            apply_force( particles[pair_i[q]], particles[pair_j[q]] ) );
+
+    BENCH( "go_through_neighbors", pairs,
+        memcpy( particles, initial, n * sizeof(particle_t) ),
+        for( int i = 0; i < num_bins; i++ )
+            go_through_neighbors( particles, bins, i ) );
+
+    /* rebinning works on its own bins, the ones above stay as they are */
+    bin_t *scratch = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+    init_bins( scratch );
+    BENCH( "init_bins", num_bins,
+        free_bins( scratch ),
+        init_bins( scratch ) );
+
+    BENCH( "insert_into_bins", n,
+        ,
+        insert_into_bins( particles, scratch, n ) );
+
+    BENCH( "move_and_update", n,
+        memcpy( particles, initial, n * sizeof(particle_t) ),
+        for( int i = 0; i < n; i++ )
+            move_and_update( particles[i], i ) );
+
+    BENCH( "move_particles", n,
+        memcpy( particles, initial, n * sizeof(particle_t) ),
+        move_particles( particles, globalIds, 0, n ) );
+
+    free_bins( bins );
+    free_bins( scratch );
+    free( bins );
+    free( scratch );
+    free( pair_i );
+    free( pair_j );
+    free( initial );
+    free( particles );
+    free( globalIds );
+    free( samples );
+
+    return 0;
+}
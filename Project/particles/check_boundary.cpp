@@ -0,0 +1,106 @@
+/*Check of the bin and hash-grid sweeps at the walls.
+
+	A particle can sit exactly on the upper wall, x == size or y == size,
+	after a reflection. Its bin must then be the last row or column, as
+	bin_of clamps it, and not one past the grid. This places particles on
+	the upper walls and in the corner, each with a neighbor just inside,
+	and checks that the forces of the bins (go_through_neighbors) and of
+	the hash grid (-hash) both match all pairs. Exits with 1 on a mismatch.
+
+To run in Linux:
+make -f Makefile_p check
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "common.h"
+
+extern int num_bins;
+extern double size;
+int *globalIds;
+
+/* largest difference of the accelerations from the reference */
+double largest_error( int n, particle_t *p, particle_t *reference )
+{
+    double error = 0;
+    for( int i = 0; i < n; i++ )
+        error = fmax( error, fmax( fabs( p[i].ax - reference[i].ax ), fabs( p[i].ay - reference[i].ay ) ) );
+    return error;
+}
+
+void zero( int n, particle_t *p )
+{
+    for( int i = 0; i < n; i++ )
+        p[i].ax = p[i].ay = 0;
+}
+
+int main( int argc, char **argv )
+{
+    int n = read_int( argc, argv, "-n", 500 );
+    int failed = 0;
+
+    for( int k = 1; k <= 3; k++ )
+    {
+        set_size( n, k );
+        particle_t *reference = (particle_t*) malloc( n * sizeof(particle_t) );
+        particle_t *p = (particle_t*) malloc( n * sizeof(particle_t) );
+        init_particles( n, reference, 1 );
+
+        /* on the upper wall, on the right wall and in the corner, each with a neighbor inside */
+        double inside = size - 0.5 * cutoff;
+        double walls[6][2] = { { 0.5 * size, size }, { 0.5 * size, inside },
+                               { size, 0.5 * size }, { inside, 0.5 * size },
+                               { size, size }, { inside, inside } };
+        for( int i = 0; i < 6; i++ )
+        {
+            reference[i].x = walls[i][0];
+            reference[i].y = walls[i][1];
+        }
+
+        zero( n, reference );
+        for( int i = 0; i < n; i++ )
+            for( int j = 0; j < n; j++ )
+                if( i != j )
+                    apply_force( reference[i], reference[j] );
+        zero( n, p );
+        double scale = largest_error( n, reference, p ) + 1;		/* the largest acceleration */
+
+        /* bins */
+        for( int i = 0; i < n; i++ )
+            p[i] = reference[i];
+        zero( n, p );
+        int *ids = (int*) malloc( n * sizeof(int) );
+        bin_t *bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+        init_bins( bins );
+        for( int i = 0; i < n; i++ )
+            ids[i] = bin_of( p[i] );
+        insert_into_bins( p, bins, ids, n );
+        for( int i = 0; i < num_bins; i++ )
+            go_through_neighbors( p, bins, i );
+        double bins_error = largest_error( n, p, reference );
+
+        /* hash grid */
+        zero( n, p );
+        hash_grid_t grid;
+        init_hash_grid( &grid, n );
+        insert_into_hash_grid( p, &grid, n );
+        for( int i = 0; i < grid.num_cells; i++ )
+            go_through_neighbors( p, &grid, i );
+        double hash_error = largest_error( n, p, reference );
+
+        int ok = bins_error <= 1e-9 * scale && hash_error <= 1e-9 * scale;
+        printf( "k = %d: largest error %g with bins, %g with the hash grid: %s\n",
+            k, bins_error, hash_error, ok ? "ok" : "FAILED" );
+        failed |= !ok;
+
+        for( int i = 0; i < num_bins; i++ )
+            sim_free( bins[i].particle_ids );
+        free( bins );
+        free( ids );
+        free( p );
+        free( reference );
+    }
+    return failed;
+}
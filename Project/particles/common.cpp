@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 #include <assert.h>
 #include <float.h>
 #include <string.h>
@@ -7,12 +8,20 @@
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "common.h"
 
 double size;
 int num_rows, num_bins;
+int bin_stride;				/* bins per row of the padded grid, num_rows + 2k */
+int cells_per_cutoff = 1;	/* k: bins are cutoff/k wide and have (2k+1)^2 neighbors */
+double bin_size = cutoff;
 extern int *globalIds;
 
+static char *arena_base = NULL;		/* see init_arena */
+static size_t arena_size = 0, arena_used = 0;
+
 
 //
 //  timer
@@ -37,10 +46,155 @@ double read_timer( )
 //
 void set_size( int n )
 {
+    set_size( n, 1 );
+}
+
+/* k > 1 splits every cutoff x cutoff cell into k x k bins. The stencil
+   then hugs the interaction disc more tightly, so fewer of the pairs
+   tested fall outside the cutoff. */
+void set_size( int n, int k )
+{
+	set_box( n, k );
+	set_rows( num_rows );
+}
+
+/* the box, the bin edge and the number of rows, but no bins: the grid
+   may have more than INT_MAX bins, which only large.cpp can index */
+void set_box( int n, int k )
+{
+	if (k < 1) {
+		printf( "-k must be at least 1, not %d\n", k );
+		exit( 1 );
+	}
     size = sqrt( density * n );
+	cells_per_cutoff = k;
+	bin_size = cutoff / k;
     /* number of columns = number of rows */
-	num_rows = (int)ceil(size / cutoff);
-	num_bins = num_rows * num_rows; 
+	double rows = ceil(size / bin_size);
+	if (rows + 2.0 * k > INT_MAX) {
+		printf( "a grid of %g x %g bins is too large\n", rows, rows );
+		exit( 1 );
+	}
+	num_rows = (int)rows;
+	bin_stride = num_rows + 2 * k;
+	num_bins = 0;
+}
+
+/* a grid of rows x rows bins, plus the padding of k bins on every side.
+   Bin ids are ints, so beyond INT_MAX bins (n > ~4e8) only large.cpp,
+   which indexes its own grid with 64-bit ids, can run */
+void set_rows( int rows )
+{
+	num_rows = rows;
+	bin_stride = rows + 2 * cells_per_cutoff;
+	if ((long long)bin_stride * bin_stride > INT_MAX) {
+		printf( "a grid of %lld bins is too large for int bin ids, use large\n", (long long)bin_stride * bin_stride );
+		exit( 1 );
+	}
+	num_bins = bin_stride * bin_stride;
+}
+
+
+/* the bin a particle is in; a particle right on the far wall goes to the last row */
+int bin_of( particle_t &p ) {
+	return bin_index(min((int)floor(p.x / bin_size), num_rows - 1), min((int)floor(p.y / bin_size), num_rows - 1));
+}
+
+/* the bin of row and column of the unpadded grid, both from 0 */
+int bin_index( int row, int col ) {
+	return (row + cells_per_cutoff) * bin_stride + col + cells_per_cutoff;
+}
+
+int bin_row( int binId ) {
+	return binId / bin_stride - cells_per_cutoff;
+}
+
+/* rows of the grid without the padding (fewer than num_rows for a slab, see hybrid.cpp) */
+int grid_rows( ) {
+	return num_bins / bin_stride - 2 * cells_per_cutoff;
+}
+
+
+//
+//  arena for the simulation state: one mapping, handed out in 64-byte
+//  aligned pieces, so that the particles, the bins and the thousands of
+//  small id arrays of the bins share a few (huge) pages instead of being
+//  scattered over separate 4K pages. Pieces are never given back; the
+//  arena lives until the program ends. Before init_arena, and when the
+//  arena is full, sim_malloc falls back to malloc.
+//
+#define HUGE_PAGE (2 << 20)
+
+/* reserve room for n particles on the current grid. The mapping is
+   lazy (and oversized for bins that grow), only touched pages count. */
+void init_arena( int n, int pages ) {
+	size_t bytes = (size_t)n * (sizeof(particle_t) + 64)
+	             + (size_t)num_bins * (sizeof(bin_t) + 4 * 64);
+	bytes = (2 * bytes + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+
+	void *base = MAP_FAILED;
+	if (pages == ARENA_HUGETLB) {
+		/* explicit huge pages come from the pool in /proc/sys/vm/nr_hugepages */
+		base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base == MAP_FAILED) {
+			printf("not enough explicit huge pages for %zu MB, using transparent ones\n", bytes >> 20);
+			pages = ARENA_THP;
+		}
+	}
+	if (base == MAP_FAILED) {
+		/* over-map so that the arena can start on a huge page boundary */
+		char *raw = (char*) mmap(NULL, bytes + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (raw == MAP_FAILED) {
+			printf("cannot map an arena of %zu MB, using malloc\n", bytes >> 20);
+			return;
+		}
+		base = (void*) (((size_t)raw + HUGE_PAGE - 1) & ~((size_t)HUGE_PAGE - 1));
+		if (pages == ARENA_THP)
+			madvise(base, bytes, MADV_HUGEPAGE);
+	}
+	arena_base = (char*) base;
+	arena_size = bytes;
+	arena_used = 0;
+}
+
+/* thread safe: sizes are rounded up to 64 bytes, so a fetch-and-add keeps every piece aligned */
+void *sim_malloc( size_t bytes ) {
+	if (arena_base) {
+		size_t rounded = (bytes + 63) & ~(size_t)63;
+		size_t at = __atomic_fetch_add(&arena_used, rounded, __ATOMIC_RELAXED);
+		if (at + rounded <= arena_size)
+			return arena_base + at;
+		__atomic_fetch_sub(&arena_used, rounded, __ATOMIC_RELAXED);
+	}
+	return malloc(bytes);
+}
+
+void *sim_realloc( void *p, size_t old_bytes, size_t bytes ) {
+	if (!arena_base)
+		return realloc(p, bytes);
+	void *q = sim_malloc(bytes);
+	if (p)
+		memcpy(q, p, old_bytes < bytes ? old_bytes : bytes);
+	sim_free(p);
+	return q;
+}
+
+/* arena pieces are not given back one by one */
+void sim_free( void *p ) {
+	if (!arena_base || (char*)p < arena_base || (char*)p >= arena_base + arena_size)
+		free(p);
+}
+
+
+/* append a particle to a bin, doubling its id array when it is full.
+   Bins only hold as many ids as they have ever needed, instead of n each. */
+void add_to_bin( bin_t* bin, int id ) {
+	if (bin->num_particles == bin->capacity) {
+		int old = bin->capacity;
+		bin->capacity = bin->capacity ? 2 * bin->capacity : 4;
+		bin->particle_ids = (int*) sim_realloc(bin->particle_ids, old * sizeof(int), bin->capacity * sizeof(int));
+	}
+	bin->particle_ids[bin->num_particles++] = id;
 }
 
 
@@ -49,87 +203,409 @@ void insert_into_bins(particle_t* particles, bin_t* bins, int first, int last, i
 	for (int i = 0; i < num_bins; i++)
 		bins[i].num_particles = 0;
 
-	for (int i = first; i < last; i++) {
-		int id = globalIds[i];
-		bins[id].particle_ids[bins[id].num_particles] = i;
-		bins[id].num_particles++;
-	}
+	for (int i = first; i < last; i++)
+		add_to_bin(&bins[globalIds[i]], i);
 }
 
 
 /* inserting the particles into the appropriate bins */
 void insert_into_bins(particle_t* particles, bin_t* bins, int n) {
+	insert_into_bins(particles, bins, globalIds, n);
+}
+
+/* the same for a simulation whose bin ids are not globalIds (ensemble.cpp) */
+void insert_into_bins(particle_t* particles, bin_t* bins, int* ids, int n) {
 	for (int i = 0; i < num_bins; i++)
 		bins[i].num_particles = 0;
 
+	for (int i = 0; i < n; i++)
+		add_to_bin(&bins[ids[i]], i);
+}
+
+
+/* remove a particle from a bin; the last particle in the bin takes its place */
+void remove_from_bin( bin_t* bin, int id ) {
+	for (int i = 0; i < bin->num_particles; i++) {
+		if (bin->particle_ids[i] == id) {
+			bin->particle_ids[i] = bin->particle_ids[--bin->num_particles];
+			return;
+		}
+	}
+}
+
+
+/* only migrate the particles whose bin changed, from globalIds to newIds.
+   Most particles stay in their bin from one step to the next, so this
+   avoids clearing every bin and reinserting all n particles. When more
+   than max_fraction of the particles moved a full rebuild is cheaper.
+   Returns the number of particles that changed bin. */
+int update_bins(particle_t* particles, bin_t* bins, int n, int* newIds, double max_fraction) {
+	int movers = 0;
+	for (int i = 0; i < n; i++)
+		movers += newIds[i] != globalIds[i];
+
+	if (movers > max_fraction * n) {
+		memcpy(globalIds, newIds, n * sizeof(int));
+		insert_into_bins(particles, bins, n);
+		return movers;
+	}
+
 	for (int i = 0; i < n; i++) {
-		int id = globalIds[i];
-		bins[id].particle_ids[bins[id].num_particles] = i;
-		bins[id].num_particles++;
+		if (newIds[i] != globalIds[i]) {
+			remove_from_bin(&bins[globalIds[i]], i);
+			add_to_bin(&bins[newIds[i]], i);
+			globalIds[i] = newIds[i];
+		}
 	}
+	return movers;
 }
 
 
-/* initialise up to 9 neighbors. */
+/* all bins start out empty, the padding stays empty.
+   The grid may be a slab of fewer than num_rows rows (hybrid.cpp). */
 void init_bins( bin_t* bins ) {
- int d_col[] = {-1, -1, -1, 0, 0, 0, 1, 1, 1};
- int d_row[] = {-1, 0, 1, -1, 0, 1, -1, 0, 1};
  for(int i = 0; i < num_bins; i++){
-	bins[i].num_neighbors = 0; 
-	bins[i].neighbors_ids = (int*) malloc(9 * sizeof(int));
-	int col = i % num_rows; 
-	int row = (i - col) / num_rows; 
-	for(int k = 0; k < 9; k++){
-		int new_col = col + d_col[k]; 
-		int new_row = row + d_row[k];
-		if(new_col >= 0 && new_row >= 0 && new_col < num_rows && new_row < num_rows) {
-			int new_id = new_col + new_row * num_rows;				
-			bins[i].neighbors_ids[bins[i].num_neighbors] = new_id; 
-			bins[i].num_neighbors++;
+	bins[i].num_particles = 0;
+	bins[i].capacity = 0;
+	bins[i].particle_ids = NULL;
+ }
+}
+
+//
+//  the neighbors of bin b are b + dr * bin_stride + dc for dr and dc in
+//  -k..k, the padding makes them exist for every bin that holds
+//  particles. K is k when it is known at compile time, so that the
+//  stencil unrolls into (2k+1)^2 fixed offsets, or 0 for any other k.
+//  The neighbors are visited column offset first, the order of the
+//  neighbor lists the bins used to keep, so the forces add up the same.
+//
+template <int K>
+static void sweep_bin(particle_t* particles, bin_t* bins, int first, int last, int binId) {
+ const int k = K ? K : cells_per_cutoff;
+ const int stride = bin_stride;
+ bin_t* bin = &bins[binId];
+
+ for (int i = 0; i < bin->num_particles; i++) {
+	int id = bin->particle_ids[i];
+	if (id < first || id >= last)
+		continue;
+	particle_t &p = particles[id];
+	for (int dc = -k; dc <= k; dc++)
+		for (int dr = -k; dr <= k; dr++) {
+			bin_t* neighbor = &bins[binId + dr * stride + dc];
+			for (int j = 0; j < neighbor->num_particles; j++)
+				apply_force(p, particles[neighbor->particle_ids[j]]);
 		}
-	}
  }
 }
 
-/* for each particle in the bin given as input argument: 
-   go through all the particles in the current and the 
-   neighboring bins and apply force between them */
-void go_through_neighbors(particle_t* particles, bin_t* bins, int binId) {
- 
+/* the pairs of bin b with itself and its neighbors of a larger id */
+template <int K>
+static void sweep_bin_symmetric(particle_t* particles, bin_t* bins, int binId) {
+ const int k = K ? K : cells_per_cutoff;
+ const int stride = bin_stride;
  bin_t* bin = &bins[binId];
 
  for (int i = 0; i < bin->num_particles; i++) {
-	for (int k = 0; k < bin->num_neighbors; k++) {
-		bin_t* neighbor = &bins[bin->neighbors_ids[k]];
-			for(int j = 0; j < neighbor->num_particles; j++){
-				apply_force(particles[bin->particle_ids[i]], particles[neighbor->particle_ids[j]]);
-			}
-	}
+	particle_t &p = particles[bin->particle_ids[i]];
+	for (int j = i + 1; j < bin->num_particles; j++)
+		apply_force_symmetric(p, particles[bin->particle_ids[j]]);
+
+	for (int dc = -k; dc <= k; dc++)
+		for (int dr = -k; dr <= k; dr++) {
+			if (dr < 0 || (dr == 0 && dc <= 0))
+				continue;
+			bin_t* neighbor = &bins[binId + dr * stride + dc];
+			for (int j = 0; j < neighbor->num_particles; j++)
+				apply_force_symmetric(p, particles[neighbor->particle_ids[j]]);
+		}
  }
 }
 
+//
+//  symmetric forces: every pair of particles is visited once and both
+//  get the force (Newton's third law), which halves the pair work. The
+//  pairs of a bin are the ones inside it and the ones with its neighbors
+//  of a larger id, so an update from bin (row, col) reaches the bins
+//  within k of it. In parallel the bins are grouped into square blocks
+//  colored as a 2x2 checkerboard: the blocks of one color are a block
+//  apart, at least 2k bins, so they never touch the same particle and
+//  can be processed concurrently without atomics. Blocks are at least
+//  8 bins wide; smaller ones lose the locality of the row-major sweep.
+//
+static int block_rows() {
+	return max(2 * cells_per_cutoff, 8);
+}
+
+/* the number of blocks of a color (0..3) */
+int num_colored_blocks( int color ) {
+	int blocks = (num_rows + block_rows() - 1) / block_rows();
+	int slab_blocks = (grid_rows() + block_rows() - 1) / block_rows();
+	return (blocks - color % 2 + 1) / 2 * ((slab_blocks - color / 2 + 1) / 2);
+}
+
+void go_through_neighbors_symmetric(particle_t* particles, bin_t* bins, int binId) {
+ switch (cells_per_cutoff) {
+ case 1:  sweep_bin_symmetric<1>(particles, bins, binId); break;
+ case 2:  sweep_bin_symmetric<2>(particles, bins, binId); break;
+ default: sweep_bin_symmetric<0>(particles, bins, binId);
+ }
+}
+
+/* symmetric forces for all bins of block j of a color */
+void go_through_block_symmetric(particle_t* particles, bin_t* bins, int color, int j) {
+ int blocks = (num_rows + block_rows() - 1) / block_rows();
+ int blocks_of_color = (blocks - color % 2 + 1) / 2;
+ int first_col = (2 * (j % blocks_of_color) + color % 2) * block_rows();
+ int first_row = (2 * (j / blocks_of_color) + color / 2) * block_rows();
+ int last_col = min(first_col + block_rows(), num_rows);
+ int last_row = min(first_row + block_rows(), grid_rows());
+
+ for (int row = first_row; row < last_row; row++)
+	for (int col = first_col; col < last_col; col++)
+		go_through_neighbors_symmetric(particles, bins, bin_index(row, col));
+}
+
+/* for each particle in the bin given as input argument: 
+   go through all the particles in the current and the 
+   neighboring bins and apply force between them */
+void go_through_neighbors(particle_t* particles, bin_t* bins, int binId) {
+ go_through_neighbors(particles, bins, 0, INT_MAX, binId);
+}
+
 
 
 /* for each particle in the bin given as input argument: 
    go through all the particles in the current and the 
    neighboring bins and apply force between them */
 void go_through_neighbors(particle_t* particles, bin_t* bins, int first, int last, int binId) {
+ switch (cells_per_cutoff) {
+ case 1:  sweep_bin<1>(particles, bins, first, last, binId); break;
+ case 2:  sweep_bin<2>(particles, bins, first, last, binId); break;
+ default: sweep_bin<0>(particles, bins, first, last, binId);
+ }
+}
 
- bin_t* bin = &bins[binId];
+//
+//  order in which to sweep the bins. Row-major order keeps the rows
+//  above and below the current one in cache only while 2k+1 rows fit in
+//  L2; on wider grids they are gone by the time they are used again.
+//  Z-order (Morton) and L2-sized tiles keep the sweep inside a small
+//  square, whatever the width of the grid.
+//
+/* tile width such that the 2k+2 rows of bins that a tile row needs fit in half of L2 */
+static int tile_width( int n ) {
+	long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	if (l2 <= 0)
+		l2 = 256 << 10;
+	double per_bin = sizeof(bin_t) + (double)n / ((double)max(grid_rows(), 1) * num_rows) * (sizeof(int) + sizeof(particle_t));
+	int width = (int)(l2 / 2 / per_bin / (2*cells_per_cutoff+2)) - 2*cells_per_cutoff;
+	return max(width, 2*cells_per_cutoff+1);
+}
 
- for (int i = 0; i < bin->num_particles; i++) {
-	if(bin->particle_ids[i] >= first && bin->particle_ids[i] < last){
-		for (int k = 0; k < bin->num_neighbors; k++) {
-			bin_t* neighbor = &bins[bin->neighbors_ids[k]];	
-			for(int j = 0; j < neighbor->num_particles; j++){
-					apply_force(particles[bin->particle_ids[i]], particles[neighbor->particle_ids[j]]);
+/* fill order with all bin ids in the given sweep order (ORDER_*).
+   The padding is always empty; it goes last */
+void init_bin_order( int *order, int mode, int n ) {
+	int slab_rows = grid_rows();
+	int k = 0;
+	if (mode == ORDER_Z) {
+		int side = 1;
+		while (side < num_rows || side < slab_rows)
+			side *= 2;
+		/* walk the Morton codes of the enclosing power-of-two square, skipping the bins outside */
+		for (long long code = 0; code < (long long)side * side; code++) {
+			int row = 0, col = 0;
+			for (int b = 0; (1LL << (2*b)) < (long long)side * side; b++) {
+				col |= ((code >> (2*b)) & 1) << b;
+				row |= ((code >> (2*b+1)) & 1) << b;
+			}
+			if (row < slab_rows && col < num_rows)
+				order[k++] = bin_index(row, col);
+		}
+	} else if (mode == ORDER_TILES) {
+		int t = tile_width(n);
+		for (int tile_row = 0; tile_row < slab_rows; tile_row += t)
+			for (int tile_col = 0; tile_col < num_rows; tile_col += t)
+				for (int row = tile_row; row < min(tile_row + t, slab_rows); row++)
+					for (int col = tile_col; col < min(tile_col + t, num_rows); col++)
+						order[k++] = bin_index(row, col);
+	} else {
+		for (int row = 0; row < slab_rows; row++)
+			for (int col = 0; col < num_rows; col++)
+				order[k++] = bin_index(row, col);
+	}
+	for (int i = 0; i < num_bins; i++) {
+		int row = bin_row(i), col = i % bin_stride - cells_per_cutoff;
+		if (row < 0 || row >= slab_rows || col < 0 || col >= num_rows)
+			order[k++] = i;
+	}
+	assert(k == num_bins);
+}
+
+//
+//  split the bin sweep into parts ranges of about the same work, for
+//  threads that each take one range. The work of a bin is estimated as
+//  the pairs go_through_neighbors tests there, its particles times the
+//  particles of its neighbors, plus one for the visit itself, which is
+//  all an empty bin costs. Part p sweeps order[first[p] .. first[p+1])
+//  (the bins themselves without an order). prefix holds num_bins + 1
+//  costs of scratch space.
+//
+void split_bins_by_cost( bin_t *bins, int *order, int parts, long long *prefix, int *first ) {
+	prefix[0] = 0;
+	for (int i = 0; i < num_bins; i++) {
+		int b = order ? order[i] : i;
+		bin_t *bin = &bins[b];
+		long long neighbors = 0;
+		if (bin->num_particles)
+			for (int dc = -cells_per_cutoff; dc <= cells_per_cutoff; dc++)
+				for (int dr = -cells_per_cutoff; dr <= cells_per_cutoff; dr++)
+					neighbors += bins[b + dr * bin_stride + dc].num_particles;
+		prefix[i+1] = prefix[i] + 1 + bin->num_particles * neighbors;
+	}
+
+	/* part p starts at the first bin whose prefix reaches p / parts of the total */
+	first[0] = 0;
+	for (int p = 1; p < parts; p++) {
+		long long target = prefix[num_bins] * p / parts;
+		int low = first[p-1], high = num_bins;
+		while (low < high) {
+			int mid = (low + high) / 2;
+			if (prefix[mid] < target)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		first[p] = low;
+	}
+	first[parts] = num_bins;
+}
+
+/* fraction of the pairs visited by the bin sweep that are actually within
+   the cutoff. Goes through the same pairs as go_through_neighbors but
+   leaves the accelerations alone. */
+double pair_hit_rate(particle_t* particles, bin_t* bins) {
+ long long tested = 0, hits = 0;
+
+ for (int b = 0; b < num_bins; b++) {
+	bin_t* bin = &bins[b];
+	for (int i = 0; i < bin->num_particles; i++) {
+		particle_t &p = particles[bin->particle_ids[i]];
+		for (int dc = -cells_per_cutoff; dc <= cells_per_cutoff; dc++)
+		for (int dr = -cells_per_cutoff; dr <= cells_per_cutoff; dr++) {
+			bin_t* neighbor = &bins[b + dr * bin_stride + dc];
+			for (int j = 0; j < neighbor->num_particles; j++) {
+				particle_t &q = particles[neighbor->particle_ids[j]];
+				double dx = q.x - p.x;
+				double dy = q.y - p.y;
+				if (dx * dx + dy * dy <= cutoff*cutoff)
+					hits++;
 			}
+			tested += neighbor->num_particles;
 		}
 	}
  }
- 
- 
+ return tested ? (double)hits / tested : 0;
+}
+
+/* the hash grid holds at most n cells, so a table of >= 2n slots
+   stays at most half full and linear probing stays short */
+void init_hash_grid( hash_grid_t* grid, int n ) {
+	grid->capacity = 1;
+	while (grid->capacity < 2 * n)
+		grid->capacity *= 2;
+	grid->num_cells = 0;
+	grid->slots = (int*) sim_malloc(grid->capacity * sizeof(int));
+	for (int i = 0; i < grid->capacity; i++)
+		grid->slots[i] = -1;
+	grid->cells = (cell_t*) sim_malloc(n * sizeof(cell_t));
+	grid->particle_ids = (int*) sim_malloc(n * sizeof(int));
+	grid->cell_ids = (int*) sim_malloc(n * sizeof(int));
+}
+
+/* clamped like bin_of, so that a particle on the upper wall stays in the last row or column */
+static long long cell_key( particle_t &p ) {
+	long long col = (long long)floor(p.x / bin_size);
+	long long row = (long long)floor(p.y / bin_size);
+	col = col < 0 ? 0 : col < num_rows ? col : num_rows - 1;
+	row = row < 0 ? 0 : row < num_rows ? row : num_rows - 1;
+	return col * num_rows + row;
+}
 
+static unsigned int hash_slot( hash_grid_t* grid, long long key ) {
+	unsigned long long h = (unsigned long long)key * 0x9e3779b97f4a7c15ULL;
+	return (unsigned int)(h >> 32) & (grid->capacity - 1);
+}
+
+/* index of the cell with the given key, or -1 if it holds no particles */
+static int find_cell( hash_grid_t* grid, long long key ) {
+	for (unsigned int s = hash_slot(grid, key); grid->slots[s] >= 0; s = (s + 1) & (grid->capacity - 1))
+		if (grid->cells[grid->slots[s]].key == key)
+			return grid->slots[s];
+	return -1;
+}
+
+/* sort the particles into the occupied cells. Only the slots used in the
+   previous step are cleared, so the cost is O(n) whatever the box size. */
+void insert_into_hash_grid(particle_t* particles, hash_grid_t* grid, int n) {
+	for (int c = 0; c < grid->num_cells; c++)
+		grid->slots[grid->cells[c].slot] = -1;
+	grid->num_cells = 0;
+
+	for (int i = 0; i < n; i++) {
+		long long key = cell_key(particles[i]);
+		unsigned int s = hash_slot(grid, key);
+		while (grid->slots[s] >= 0 && grid->cells[grid->slots[s]].key != key)
+			s = (s + 1) & (grid->capacity - 1);
+		if (grid->slots[s] < 0) {
+			cell_t* cell = &grid->cells[grid->num_cells];
+			cell->key = key;
+			cell->slot = s;
+			cell->num_particles = 0;
+			grid->slots[s] = grid->num_cells++;
+		}
+		grid->cell_ids[i] = grid->slots[s];
+		grid->cells[grid->slots[s]].num_particles++;
+	}
+
+	int first = 0;
+	for (int c = 0; c < grid->num_cells; c++) {
+		grid->cells[c].first = first;
+		first += grid->cells[c].num_particles;
+		grid->cells[c].num_particles = 0;
+	}
+	for (int i = 0; i < n; i++) {
+		cell_t* cell = &grid->cells[grid->cell_ids[i]];
+		grid->particle_ids[cell->first + cell->num_particles++] = i;
+	}
+}
+
+/* same as for the bins, but the neighbors of an occupied cell are looked
+   up in the hash table and empty ones are skipped */
+void go_through_neighbors(particle_t* particles, hash_grid_t* grid, int cellId) {
+
+ cell_t* cell = &grid->cells[cellId];
+ int k_max = cells_per_cutoff;
+ long long col = cell->key / num_rows;
+ long long row = cell->key % num_rows;
+ int* ids = &grid->particle_ids[cell->first];
+
+ for (long long c = col - k_max; c <= col + k_max; c++) {
+	if (c < 0 || c >= num_rows)
+		continue;
+	for (long long r = row - k_max; r <= row + k_max; r++) {
+		if (r < 0 || r >= num_rows)
+			continue;
+		int neighborId = find_cell(grid, c * num_rows + r);
+		if (neighborId < 0)
+			continue;
+		cell_t* neighbor = &grid->cells[neighborId];
+		int* neighbor_ids = &grid->particle_ids[neighbor->first];
+		for (int i = 0; i < cell->num_particles; i++)
+			for (int j = 0; j < neighbor->num_particles; j++)
+				apply_force(particles[ids[i]], particles[neighbor_ids[j]]);
+	}
+ }
 }
 
 void move_and_update( particle_t &p, int  id){
@@ -159,7 +635,7 @@ void move_and_update( particle_t &p, int  id){
 	p.ax = 0; 
 	p.ay = 0;
 
-	globalIds[id] = (int)(floor(p.x / cutoff) * num_rows + floor(p.y / cutoff));
+	globalIds[id] = bin_of(p);
 }
 
 
@@ -191,45 +667,174 @@ void move_and_update( particle_t &p, int  id, int &globalId){
 	p.ax = 0; 
 	p.ay = 0;
 
-	globalId = (int)(floor(p.x / cutoff) * num_rows + floor(p.y / cutoff));
+	globalId = bin_of(p);
+}
+
+/* move particles [first,last) and store their new bins in ids.
+   Same integration as move_and_update, but without data-dependent
+   branches so that the loop vectorizes: every wall reflects a particle
+   at most once, and the rare particle that is still outside afterwards
+   (it crossed the whole box in one step) is fixed by a scalar pass.
+   Positions are never negative, so truncation gives the same bin as floor. */
+void move_particles( particle_t *p, int *ids, int first, int last ) {
+	const double box = size, cell = bin_size;
+	const int last_row = num_rows - 1, stride = bin_stride, pad = cells_per_cutoff;
+	int escaped = 0;
+
+	#pragma omp simd reduction(|:escaped)
+	for (int i = first; i < last; i++) {
+		double vx = p[i].vx + p[i].ax * dt;
+		double vy = p[i].vy + p[i].ay * dt;
+		double x  = p[i].x + vx * dt;
+		double y  = p[i].y + vy * dt;
+
+		int out_x = (x < 0) | (x > box);
+		int out_y = (y < 0) | (y > box);
+		double rx = x < 0 ? -x : 2*box-x;
+		double ry = y < 0 ? -y : 2*box-y;
+		x  = out_x ? rx : x;
+		y  = out_y ? ry : y;
+		vx = out_x ? -vx : vx;
+		vy = out_y ? -vy : vy;
+		escaped |= (x < 0) | (x > box) | (y < 0) | (y > box);
+
+		p[i].x = x;   p[i].y = y;
+		p[i].vx = vx; p[i].vy = vy;
+		p[i].ax = 0;  p[i].ay = 0;
+		/* as bin_of */
+		ids[i] = (min((int)(x / cell), last_row) + pad) * stride + min((int)(y / cell), last_row) + pad;
+	}
+
+	if (!escaped)
+		return;
+	for (int i = first; i < last; i++) {
+		particle_t &q = p[i];
+		if (q.x >= 0 && q.x <= box && q.y >= 0 && q.y <= box)
+			continue;
+		while( q.x < 0 || q.x > box )
+		{
+			q.x  = q.x < 0 ? -q.x : 2*box-q.x;
+			q.vx = -q.vx;
+		}
+		while( q.y < 0 || q.y > box )
+		{
+			q.y  = q.y < 0 ? -q.y : 2*box-q.y;
+			q.vy = -q.vy;
+		}
+		ids[i] = bin_of(q);
+	}
+}
+
+//
+//  counter-based random numbers: every value is a pure function of
+//  (seed, stream, counter), so particles can be initialised in any
+//  order and by any number of threads with identical results
+//
+static unsigned long long mix64( unsigned long long z )
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static unsigned long long random_at( int seed, int stream, unsigned long long i )
+{
+    unsigned long long key = mix64( (unsigned long long)(unsigned int)seed * 0x9e3779b97f4a7c15ULL + stream );
+    return mix64( key ^ mix64( i ) );
+}
+
+static double uniform_at( int seed, int stream, unsigned long long i )
+{
+    return (random_at( seed, stream, i ) >> 11) * (1.0 / 9007199254740992.0);
 }
 
 //
-//  Initialize the particle positions and velocities
+//  bijection on [0,n): a 4-round Feistel network over the smallest
+//  even power of two >= n, cycle-walking until the result lands in range.
+//  Replaces the serial Fisher-Yates shuffle.
 //
-void init_particles( int n, particle_t *p )
+static unsigned long long permute( unsigned long long i, unsigned long long n, int seed )
+{
+    int half = 1;
+    while( (1ULL << (2*half)) < n )
+        half++;
+    unsigned long long mask = (1ULL << half) - 1;
+
+    do
+    {
+        unsigned long long l = i >> half, r = i & mask;
+        for( int round = 0; round < 4; round++ )
+        {
+            unsigned long long t = l ^ (random_at( seed, 2 + round, r ) & mask);
+            l = r;
+            r = t;
+        }
+        i = (l << half) | r;
+    } while( i >= n );
+    return i;
+}
+
+//
+//  Initialize the positions and velocities of particles [first,last)
+//  of the system, storing them in p[0 .. last-first)
+//
+void init_particles( int n, particle_t *p, int seed, int first, int last )
 {
-    srand48( time( NULL ) );
-        
     int sx = (int)ceil(sqrt((double)n));
     int sy = (n+sx-1)/sx;
     
-    int *shuffle = (int*)malloc( n * sizeof(int) );
-    for( int i = 0; i < n; i++ )
-        shuffle[i] = i;
-    
-    for( int i = 0; i < n; i++ ) 
+    for( int i = first; i < last; i++ ) 
     {
+        particle_t &q = p[i-first];
+
         //
         //  make sure particles are not spatially sorted
         //
-        int j = lrand48()%(n-i);
-        int k = shuffle[j];
-        shuffle[j] = shuffle[n-i-1];
+        int k = (int)permute( i, n, seed );
         
         //
         //  distribute particles evenly to ensure proper spacing
         //
-        p[i].x = size*(1.+(k%sx))/(1+sx);
-        p[i].y = size*(1.+(k/sx))/(1+sy);
+        q.x = size*(1.+(k%sx))/(1+sx);
+        q.y = size*(1.+(k/sx))/(1+sy);
 
         //
         //  assign random velocities within a bound
         //
-        p[i].vx = drand48()*2-1;
-        p[i].vy = drand48()*2-1;
+        q.vx = uniform_at( seed, 0, i )*2-1;
+        q.vy = uniform_at( seed, 1, i )*2-1;
+        q.ax = q.ay = 0;
     }
-    free( shuffle );
+}
+
+void init_particles( int n, particle_t *p, int seed )
+{
+    init_particles( n, p, seed, 0, n );
+}
+
+void init_particles( int n, particle_t *p )
+{
+    init_particles( n, p, (int)time( NULL ), 0, n );
+}
+
+//
+//  interact two particles, both ways: the force on the neighbor is
+//  exactly minus the force on the particle
+//
+void apply_force_symmetric( particle_t &particle, particle_t &neighbor ){
+	double dx = neighbor.x - particle.x;
+	double dy = neighbor.y - particle.y;
+	double r2 = dx * dx + dy * dy;
+	if( r2 > cutoff*cutoff )
+		return;
+	r2 = fmax( r2, min_r*min_r );
+	double r = sqrt( r2 );
+
+	double coef = ( 1 - cutoff / r ) / r2 / mass;
+	particle.ax += coef * dx;
+	particle.ay += coef * dy;
+	neighbor.ax -= coef * dx;
+	neighbor.ay -= coef * dy;
 }
 
 //
@@ -292,6 +897,11 @@ void save( FILE *f, int n, particle_t *p ){
         fprintf( f, "%d %g\n", n, size );
         first = false;
     }
+    save_frame( f, n, p );
+}
+
+/* the positions only; save writes the "n size" header once per process */
+void save_frame( FILE *f, int n, particle_t *p ){
     for( int i = 0; i < n; i++ )
         fprintf( f, "%g %g\n", p[i].x, p[i].y );
 }
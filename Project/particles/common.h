@@ -34,14 +34,55 @@ typedef struct
 } particle_t;
 
 
+//
+// the bins form a grid padded with k rows and columns of bins that
+// always stay empty, so every bin that holds particles has all its
+// (2k+1)^2 neighbors at fixed offsets, see go_through_neighbors
+//
 typedef struct{
 	int num_particles;
-	int num_neighbors; 
-	int* neighbors_ids; 
+	int capacity;		/* grown on demand, see add_to_bin */
 	int* particle_ids;
 } bin_t;
 
 
+//
+// sparse alternative to the bins: a hash table keyed by cell
+// coordinates that only stores the cells that hold particles
+//
+typedef struct{
+	long long key;			/* col * num_rows + row */
+	int slot;				/* where the cell sits in the hash table */
+	int first;				/* its particles are particle_ids[first .. first+num_particles) */
+	int num_particles;
+} cell_t;
+
+typedef struct{
+	int capacity;			/* hash table size, a power of two >= 2n */
+	int num_cells;			/* occupied cells */
+	int* slots;				/* index into cells, -1 if empty */
+	cell_t* cells;
+	int* particle_ids;		/* all particles, grouped by cell */
+	int* cell_ids;			/* cell of every particle */
+} hash_grid_t;
+
+
+
+//
+// binary trajectory file: this header, then one frame per saved step
+// holding x and y (as doubles) of every particle in particle order,
+// so frame f starts at sizeof(trajectory_header_t) + f*n*2*sizeof(double)
+//
+#define TRAJECTORY_MAGIC "PARTTRJ"
+
+typedef struct{
+	char magic[8];			/* TRAJECTORY_MAGIC */
+	int n;
+	int reserved;
+	double size;
+} trajectory_header_t;
+
+
 
 //
 //  timing routines
@@ -50,27 +91,69 @@ double read_timer( );
 
 
 
+//
+//  memory for the simulation state, see init_arena
+//
+#define ARENA_4K      0		/* regular pages */
+#define ARENA_THP     1		/* transparent huge pages (madvise) */
+#define ARENA_HUGETLB 2		/* explicit huge pages (MAP_HUGETLB), THP if there are not enough */
+
+void init_arena( int n, int pages );
+void *sim_malloc( size_t bytes );
+void *sim_realloc( void *p, size_t old_bytes, size_t bytes );
+void sim_free( void *p );
+
 //
 //  simulation routines
 //
 void set_size( int n );
+void set_size( int n, int k );
+void set_box( int n, int k );
+void set_rows( int rows );
+int bin_of( particle_t &p );
+int bin_index( int row, int col );
+int bin_row( int binId );
+int grid_rows( );
 void init_particles( int n, particle_t *p );	
+void init_particles( int n, particle_t *p, int seed );
+void init_particles( int n, particle_t *p, int seed, int first, int last );
 void apply_force( particle_t &particle, particle_t &neighbor );
+void apply_force_symmetric( particle_t &particle, particle_t &neighbor );
 void move( particle_t &p );
 
 void go_through_neighbors(particle_t* , bin_t* , int  );
 void go_through_neighbors(particle_t* , bin_t* , int , int , int );
+void go_through_neighbors_symmetric(particle_t* , bin_t* , int );
+int num_colored_blocks( int color );
+void go_through_block_symmetric(particle_t* , bin_t* , int , int );
 void move_and_update( particle_t& , int , int&);
 void move_and_update( particle_t& , int );
+void move_particles( particle_t *p, int *ids, int first, int last );
 void init_bins( bin_t*  );
+void add_to_bin( bin_t* , int );
+void remove_from_bin( bin_t* , int );
 void insert_into_bins(particle_t* , bin_t* , int );
+void insert_into_bins(particle_t* , bin_t* , int* , int );
 void insert_into_bins(particle_t* , bin_t* , int , int, int);
+int update_bins(particle_t* , bin_t* , int , int* , double );
+double pair_hit_rate(particle_t* , bin_t* );
+
+#define ORDER_ROWS  0		/* bin sweep orders, see init_bin_order */
+#define ORDER_Z     1
+#define ORDER_TILES 2
+void init_bin_order( int *order, int mode, int n );
+void split_bins_by_cost( bin_t *bins, int *order, int parts, long long *prefix, int *first );
+
+void init_hash_grid( hash_grid_t* , int );
+void insert_into_hash_grid(particle_t* , hash_grid_t* , int );
+void go_through_neighbors(particle_t* , hash_grid_t* , int );
 
 //
 //  I/O routines
 //
 FILE *open_save( char *filename, int n );
 void save( FILE *f, int n, particle_t *p );
+void save_frame( FILE *f, int n, particle_t *p );
 
 
 
@@ -0,0 +1,223 @@
+/*Compares two trajectories, e.g. an optimized build against serial.
+
+	Both files are streamed one frame at a time, so they can be far larger
+	than memory. Each file can be a text trajectory (save) or a binary one
+	(TRAJECTORY_MAGIC header, see common.h). For every frame it prints
+	the largest and the RMS distance between the positions of the same
+	particle in the two files. At the end it prints the first frame where
+	the largest distance exceeds the threshold.
+
+	Binary frames sit at known offsets. When both files are binary, the
+	frames are read with pread and compared by OpenMP threads in
+	parallel. Text files have to be parsed in order, so any text input
+	makes the comparison sequential.
+
+	Exit status: 0 if all frames are within the threshold, 1 if one is
+	not, 2 if the files cannot be compared.
+
+To run in Linux:
+make -f Makefile_p compare
+./compare -a serial.txt -b openmp.txt -t 1e-4
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <omp.h>
+#include "common.h"
+
+int *globalIds;				/* only used by the simulators */
+
+typedef struct {
+	FILE *f;
+	int binary;
+	int n;
+	double size;
+	long long frames;		/* binary only, text files are read until they end */
+} trajectory_t;
+
+typedef struct {
+	double max;
+	double rms;
+} divergence_t;
+
+/* open a trajectory and read its header */
+int open_trajectory( trajectory_t *t, const char *name ) {
+	t->f = fopen( name, "rb" );
+	if (!t->f) {
+		printf( "cannot open %s\n", name );
+		return 0;
+	}
+
+	trajectory_header_t header;
+	if (fread( &header, sizeof(header), 1, t->f ) == 1 && memcmp( header.magic, TRAJECTORY_MAGIC, sizeof(TRAJECTORY_MAGIC) ) == 0) {
+		struct stat st;
+		fstat( fileno( t->f ), &st );
+		t->binary = 1;
+		t->n = header.n;
+		t->size = header.size;
+		t->frames = (st.st_size - (long long)sizeof(header)) / ((long long)header.n * 2 * sizeof(double));
+		return 1;
+	}
+
+	rewind( t->f );
+	t->binary = 0;
+	t->frames = -1;
+	if (fscanf( t->f, "%d%lf", &t->n, &t->size ) != 2) {
+		printf( "%s is not a trajectory\n", name );
+		return 0;
+	}
+	return 1;
+}
+
+/* read frame f (binary files) or the next frame (text files) as n (x,y) pairs */
+int read_frame( trajectory_t *t, long long f, double *xy ) {
+	size_t bytes = (size_t)t->n * 2 * sizeof(double);
+	if (t->binary)
+		return pread( fileno( t->f ), xy, bytes, sizeof(trajectory_header_t) + f * bytes ) == (ssize_t)bytes;
+
+	for (int i = 0; i < t->n; i++)
+		if (fscanf( t->f, "%lf%lf", &xy[2*i], &xy[2*i+1] ) != 2)
+			return 0;
+	return 1;
+}
+
+divergence_t compare_frame( int n, double *a, double *b ) {
+	divergence_t d = { 0, 0 };
+	for (int i = 0; i < n; i++) {
+		double dx = a[2*i] - b[2*i];
+		double dy = a[2*i+1] - b[2*i+1];
+		double r2 = dx * dx + dy * dy;
+		d.max = fmax( d.max, r2 );
+		d.rms += r2;
+	}
+	d.max = sqrt( d.max );
+	d.rms = sqrt( d.rms / n );
+	return d;
+}
+
+//
+//  comparison program
+//
+int main( int argc, char **argv )
+{
+    /* without both trajectories nothing was compared, which must not pass */
+    int help = find_option( argc, argv, "-h" ) >= 0;
+    if( help || find_option( argc, argv, "-a" ) < 0 || find_option( argc, argv, "-b" ) < 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-a <filename> the reference trajectory\n" );
+        printf( "-b <filename> the trajectory to check\n" );
+        printf( "-t <float> to set the largest allowed distance (default: 1e-4, i.e. cutoff/100)\n" );
+        printf( "-p <int> to set the number of threads (default: OMP_NUM_THREADS)\n" );
+        printf( "-q to only print the summary\n" );
+        return help ? 0 : 2;
+    }
+
+    char *threshold_arg = read_string( argc, argv, "-t", NULL );
+    double threshold = threshold_arg ? atof( threshold_arg ) : min_r;
+    int n_threads = read_int( argc, argv, "-p", 0 );
+    int quiet = find_option( argc, argv, "-q" ) >= 0;
+
+    if( n_threads > 0 )
+        omp_set_num_threads( n_threads );
+
+    trajectory_t a, b;
+    if( !open_trajectory( &a, read_string( argc, argv, "-a", NULL ) ) ||
+        !open_trajectory( &b, read_string( argc, argv, "-b", NULL ) ) )
+        return 2;
+    if( a.n != b.n )
+    {
+        printf( "the trajectories have %d and %d particles\n", a.n, b.n );
+        return 2;
+    }
+    int n = a.n;
+    /* text headers keep 6 digits of the size, binary ones all of them */
+    if( fabs( a.size - b.size ) > 1e-5 * fmax( a.size, b.size ) )
+        printf( "warning: box sizes differ (%g and %g)\n", a.size, b.size );
+
+    long long frames = 0, first_over = -1;
+    double worst = 0;
+    if( !quiet )
+        printf( "# frame  max distance  RMS distance\n" );
+
+    if( a.binary && b.binary )
+    {
+        frames = a.frames < b.frames ? a.frames : b.frames;
+        if( a.frames != b.frames )
+            printf( "warning: the trajectories have %lld and %lld frames\n", a.frames, b.frames );
+
+        /* results are gathered per batch of frames so that they print in order */
+        const long long batch = 1024;
+        divergence_t *d = (divergence_t*) malloc( batch * sizeof(divergence_t) );
+
+        #pragma omp parallel
+        {
+            double *xa = (double*) malloc( (size_t)n * 2 * sizeof(double) );
+            double *xb = (double*) malloc( (size_t)n * 2 * sizeof(double) );
+
+            for( long long first = 0; first < frames; first += batch )
+            {
+                long long last = first + batch < frames ? first + batch : frames;
+
+                #pragma omp for schedule(dynamic)
+                for( long long f = first; f < last; f++ )
+                {
+                    if( read_frame( &a, f, xa ) && read_frame( &b, f, xb ) )
+                        d[f - first] = compare_frame( n, xa, xb );
+                    else
+                        d[f - first].max = d[f - first].rms = NAN;
+                }
+
+                #pragma omp single
+                for( long long f = first; f < last; f++ )
+                {
+                    if( !quiet )
+                        printf( "%7lld  %12.6g  %12.6g\n", f, d[f - first].max, d[f - first].rms );
+                    if( first_over < 0 && !(d[f - first].max <= threshold) )
+                        first_over = f;
+                    worst = fmax( worst, d[f - first].max );
+                }
+            }
+
+            free( xa );
+            free( xb );
+        }
+        free( d );
+    }
+    else
+    {
+        double *xa = (double*) malloc( (size_t)n * 2 * sizeof(double) );
+        double *xb = (double*) malloc( (size_t)n * 2 * sizeof(double) );
+
+        while( read_frame( &a, frames, xa ) && read_frame( &b, frames, xb ) )
+        {
+            divergence_t d = compare_frame( n, xa, xb );
+            if( !quiet )
+                printf( "%7lld  %12.6g  %12.6g\n", frames, d.max, d.rms );
+            if( first_over < 0 && !(d.max <= threshold) )
+                first_over = frames;
+            worst = fmax( worst, d.max );
+            frames++;
+        }
+
+        free( xa );
+        free( xb );
+    }
+
+    printf( "n = %d, frames compared = %lld, largest distance = %g\n", n, frames, worst );
+    if( first_over >= 0 )
+        printf( "first frame over %g: %lld\n", threshold, first_over );
+    else
+        printf( "all frames within %g\n", threshold );
+
+    fclose( a.f );
+    fclose( b.f );
+
+    return first_over >= 0 ? 1 : 0;
+}
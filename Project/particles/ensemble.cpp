@@ -0,0 +1,151 @@
+/*Particle simulator for ensembles of small runs.
+
+	A parameter sweep runs many small simulations, and at a few thousand
+	particles the threads of openmp.cpp or pthreads.cpp spend more time
+	at barriers than in the force sweep. Here the threads are a pool
+	that runs m independent simulations, each one on a single thread
+	from start to finish, handing out the next one whenever a thread
+	becomes free. Simulation i uses seed s + i and saves to <prefix><i>.txt,
+	so simulation i with seed s is the same as serial with seed s + i.
+
+	The grid only depends on n and k, which are the same for all the
+	simulations, so they share the globals of common.cpp; the bin ids
+	of every simulation are its own instead of globalIds.
+
+To run in Linux:
+make -f Makefile_p ensemble
+./ensemble
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include "common.h"
+
+extern int num_bins;
+extern double size;
+int *globalIds;				/* not used, every simulation has its own bin ids */
+
+//
+//  one whole simulation on the calling thread
+//
+void simulate( int n, int seed, FILE *fsave )
+{
+    particle_t *particles = (particle_t*) sim_malloc( n * sizeof(particle_t) );
+    int *ids = (int*) sim_malloc( n * sizeof(int) );
+    bin_t *bins = (bin_t*) sim_malloc( num_bins * sizeof(bin_t) );
+
+    init_particles( n, particles, seed );
+    init_bins( bins );
+    for( int i = 0; i < n; i++ )
+        ids[i] = bin_of( particles[i] );
+    insert_into_bins( particles, bins, ids, n );
+
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        for( int i = 0; i < n; i++ )
+            particles[i].ax = particles[i].ay = 0;
+        for( int i = 0; i < num_bins; i++ )
+            go_through_neighbors( particles, bins, i );
+        move_particles( particles, ids, 0, n );
+        insert_into_bins( particles, bins, ids, n );
+
+#ifdef DEBUG
+        /* checking that the number of particles doesnt change */
+        int numparticles = 0;
+        for( int i = 0; i < num_bins; i++ )
+            numparticles += bins[i].num_particles;
+        assert( numparticles == n );
+#endif
+
+        if( fsave && (step%SAVEFREQ) == 0 )
+            save_frame( fsave, n, particles );
+    }
+
+    for( int i = 0; i < num_bins; i++ )
+        sim_free( bins[i].particle_ids );
+    sim_free( bins );
+    sim_free( ids );
+    sim_free( particles );
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set the number of particles of every simulation\n" );
+        printf( "-m <int> to set the number of simulations (default: 16)\n" );
+        printf( "-p <int> to set the number of threads (default: OMP_NUM_THREADS)\n" );
+        printf( "-o <prefix> to save simulation i to <prefix><i>.txt\n" );
+        printf( "-s <int> to set the random seed of simulation 0, simulation i uses seed + i (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    int m = read_int( argc, argv, "-m", 16 );
+    int n_threads = read_int( argc, argv, "-p", 0 );
+    char *prefix = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+
+    if( n_threads > 0 )
+        omp_set_num_threads( n_threads );
+
+    set_size( n, k );
+    double *times = (double*) malloc( m * sizeof(double) );
+
+    //
+    //  run the simulations, one per thread at a time
+    //
+    double simulation_time = read_timer( );
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for( int i = 0; i < m; i++ )
+    {
+        FILE *fsave = NULL;
+        if( prefix )
+        {
+            char savename[1024];
+            snprintf( savename, sizeof(savename), "%s%d.txt", prefix, i );
+            fsave = fopen( savename, "w" );
+            if( fsave )
+                fprintf( fsave, "%d %g\n", n, size );
+        }
+
+        times[i] = read_timer( );
+        simulate( n, seed + i, fsave );
+        times[i] = read_timer( ) - times[i];
+
+        if( fsave )
+            fclose( fsave );
+    }
+    simulation_time = read_timer( ) - simulation_time;
+
+    double fastest = times[0], slowest = times[0], total = 0;
+    for( int i = 0; i < m; i++ )
+    {
+        fastest = fmin( fastest, times[i] );
+        slowest = fmax( slowest, times[i] );
+        total += times[i];
+    }
+    double particle_steps = (double)m * n * NSTEPS;
+
+    printf( "n = %d, m = %d, n_threads = %d, simulation time = %g seconds\n", n, m, omp_get_max_threads(), simulation_time );
+    printf( "one simulation: %g s fastest, %g s mean, %g s slowest\n", fastest, total / m, slowest );
+    printf( "throughput = %.3g particle-steps/s, %.3g per thread\n",
+        particle_steps / simulation_time, particle_steps / simulation_time / omp_get_max_threads() );
+
+    free( times );
+
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*Particle simulator with a fused step.
+
+	serial.cpp makes four passes over all particles per step: zero the
+	accelerations, sweep the forces, move, and rebin. Here the particles
+	are kept as copies grouped by bin, like the ids of the hash grid, so
+	the neighbors in one row of the stencil are one contiguous range. One
+	sweep over the bins does everything for a particle at once: it sums
+	the force in a local accumulator, moves the particle, writes it to a
+	second buffer and counts it in its new bin. The neighbors are read
+	from the first buffer, which the sweep never writes. What is left of
+	the rebin is a prefix sum over the bins and one streaming copy back
+	into bin order. The particle array is only written on the steps that
+	are saved, from the ids kept next to every copy.
+
+	The stencil is swept row by row and the particles of a bin are in a
+	different order than in serial.cpp, so the forces are summed in a
+	different order. The positions match serial to rounding; check the
+	saved trajectory with compare rather than diff.
+
+To run in Linux:
+make -f Makefile_p fused
+./fused
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include "common.h"
+
+extern int num_bins, num_rows, bin_stride, cells_per_cutoff;
+int *globalIds;
+
+/* a particle, its index in the particle array and the bin it moved to */
+typedef struct{
+	particle_t p;
+	int id;
+	int bin;
+} slot_t;
+
+//
+//  forces and move of every particle of bin b. The particles of bin c are
+//  slots[first[c] .. first[c+1]); the moved ones go to the same place in
+//  moved, and count gets the number of particles of every new bin. The
+//  force is apply_force written out, so that the sum stays in registers
+//  (apply_force lives in common.cpp and is not inlined here). The grid is
+//  padded with k empty bins on every side, so the stencil is never clipped
+//
+void step_bin( slot_t *slots, int *first, slot_t *moved, int *count, int b )
+{
+	int k = cells_per_cutoff;
+
+	for( int i = first[b]; i < first[b+1]; i++ )
+	{
+		particle_t p = slots[i].p;
+		double ax = 0, ay = 0;
+		for( int r = b - k * bin_stride; r <= b + k * bin_stride; r += bin_stride )
+			for( int j = first[r - k]; j < first[r + k + 1]; j++ )
+			{
+				double dx = slots[j].p.x - p.x;
+				double dy = slots[j].p.y - p.y;
+				double r2 = dx * dx + dy * dy;
+				if( r2 > cutoff*cutoff )
+					continue;
+				r2 = fmax( r2, min_r*min_r );
+				double r = sqrt( r2 );
+				double coef = ( 1 - cutoff / r ) / r2 / mass;
+				ax += coef * dx;
+				ay += coef * dy;
+			}
+		p.ax = ax;
+		p.ay = ay;
+		move( p );
+
+		moved[i].p = p;
+		moved[i].id = slots[i].id;
+		moved[i].bin = bin_of( p );
+		count[moved[i].bin]++;
+	}
+}
+
+/* group the moved particles by bin again, keeping their order within a bin */
+void rebin( slot_t *moved, int n, int *count, slot_t *slots, int *first )
+{
+	first[0] = 0;
+	for( int b = 0; b < num_bins; b++ )
+	{
+		first[b+1] = first[b] + count[b];
+		count[b] = first[b];
+	}
+	for( int i = 0; i < n; i++ )
+		slots[count[moved[i].bin]++] = moved[i];
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set the number of particles\n" );
+        printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-arena <int> to keep all simulation state in one arena on 0: 4K pages, 1: transparent huge pages, 2: explicit huge pages\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    char *savename = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+    int arena_pages = read_int( argc, argv, "-arena", -1 );
+
+    FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
+    set_size( n, k );
+    if( arena_pages >= 0 )
+        init_arena( 2 * n, arena_pages );
+    particle_t *particles = (particle_t*) sim_malloc( n * sizeof(particle_t) );
+    init_particles( n, particles, seed );
+
+    slot_t *slots = (slot_t*) sim_malloc( n * sizeof(slot_t) );
+    slot_t *moved = (slot_t*) sim_malloc( n * sizeof(slot_t) );
+    int *first = (int*) sim_malloc( (num_bins + 1) * sizeof(int) );
+    int *count = (int*) sim_malloc( num_bins * sizeof(int) );
+
+    /* the initial grouping is a rebin of the particles as they are */
+    memset( count, 0, num_bins * sizeof(int) );
+    for( int i = 0; i < n; i++ )
+    {
+        moved[i].p = particles[i];
+        moved[i].id = i;
+        moved[i].bin = bin_of( particles[i] );
+        count[moved[i].bin]++;
+    }
+    rebin( moved, n, count, slots, first );
+
+    //
+    //  simulate a number of time steps
+    //
+    double simulation_time = read_timer( );
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        memset( count, 0, num_bins * sizeof(int) );
+        for( int b = 0; b < num_bins; b++ )
+            step_bin( slots, first, moved, count, b );
+        rebin( moved, n, count, slots, first );
+
+#ifdef DEBUG
+        /* checking that the number of particles doesnt change */
+        assert( first[num_bins] == n );
+#endif
+
+        //
+        //  save if necessary
+        //
+        if( fsave && (step%SAVEFREQ) == 0 )
+        {
+            for( int i = 0; i < n; i++ )
+                particles[slots[i].id] = slots[i].p;
+            save( fsave, n, particles );
+        }
+    }
+    simulation_time = read_timer( ) - simulation_time;
+
+    printf( "n = %d, simulation time = %g seconds\n", n, simulation_time );
+
+    sim_free( particles );
+    if( fsave )
+        fclose( fsave );
+
+    return 0;
+}
@@ -0,0 +1,712 @@
+/*Hybrid MPI + OpenMP particle simulator.
+
+	The box is cut into slabs of bin rows, one slab per MPI rank. A rank
+	only keeps the particles in its own slab plus a ghost layer of k bin
+	rows (one cutoff) copied from each neighboring slab, and an OpenMP
+	team runs the binned force sweep and the move over that slab.
+	All MPI calls are made by the master thread (MPI_THREAD_FUNNELED).
+
+	Every step a rank only sends to the ranks of the two neighboring slabs:
+	particles that left the slab migrate to them, and the k border rows
+	are sent to them as ghosts. The one global call is a one-int
+	MPI_Allreduce after every round of migration, which tells all ranks
+	whether a particle that jumped past the next slab must be forwarded
+	once more (see migrate); it is counted in the messages reported. Ghosts only feed apply_force, so only
+	their positions are sent: 16 bytes instead of the 48 of a full
+	particle_t, or 8 with -f (single precision). Full records only travel
+	when a particle migrates.
+
+	With -o every rank writes its own particles of each saved frame
+	straight into a shared binary trajectory (see trajectory_header_t)
+	with collective MPI-IO, so no rank ever holds the whole system.
+	-t still gathers text frames on rank 0, for small runs.
+
+	Running one rank per socket or node instead of one per core means
+	fewer, larger slabs: threads on the same node share the particles
+	instead of exchanging halos, so there are fewer messages and less
+	ghost data per step.
+
+To run in Linux:
+make -f Makefile_p hybrid
+mpirun -n #ranks ./hybrid -p #threads
+
+*/
+
+#include <mpi.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <string.h>
+#include "common.h"
+#include "trace.h"
+
+extern int num_bins, num_rows, bin_stride, cells_per_cutoff;
+extern double size;
+int *globalIds;
+
+int n_proc, rank;
+int first_row, last_row;		/* bin rows [first_row, last_row) form this rank's slab */
+int left, right;				/* ranks of the neighboring slabs, or MPI_PROC_NULL */
+
+particle_t *local;				/* owned particles [0, nlocal), then the ghosts */
+int *local_ids;					/* index of every owned particle in the whole system */
+int nlocal, nghost, capacity;
+
+particle_t *send_buf;			/* particles on their way to a neighbor */
+int *send_ids;
+int send_capacity;
+
+char *halo_out, *halo_in;		/* packed ghost positions */
+int halo_out_capacity, halo_in_capacity;
+int halo_single;				/* -f: ghost positions as floats */
+int position_size;				/* bytes per ghost on the wire */
+
+MPI_Datatype PARTICLE, POSITION, XY;		/* XY: a position in the trajectory file */
+long long messages, halo_bytes, migration_bytes;
+
+//
+//  slab decomposition: rows are split as evenly as possible
+//
+int slab_start( int r )
+{
+    return (int)((long long)r * num_rows / n_proc);
+}
+
+int owner( int row )
+{
+    return (int)(((long long)(row + 1) * n_proc - 1) / num_rows);
+}
+
+/* an allreduce costs every rank about log2(ranks) messages (recursive doubling) */
+int allreduce_messages( )
+{
+    int count = 0;
+    for( int p = 1; p < n_proc; p *= 2 )
+        count++;
+    return count;
+}
+
+int row_of( particle_t &p )
+{
+    return bin_row( bin_of( p ) );
+}
+
+//
+//  make room for count local particles
+//
+void reserve( int count )
+{
+    if( count <= capacity )
+        return;
+    capacity = 2 * count;
+    local = (particle_t*) realloc( local, capacity * sizeof(particle_t) );
+    local_ids = (int*) realloc( local_ids, capacity * sizeof(int) );
+    globalIds = (int*) realloc( globalIds, capacity * sizeof(int) );
+}
+
+void reserve_send( int count )
+{
+    if( count <= send_capacity )
+        return;
+    send_capacity = 2 * count;
+    send_buf = (particle_t*) realloc( send_buf, send_capacity * sizeof(particle_t) );
+    send_ids = (int*) realloc( send_ids, send_capacity * sizeof(int) );
+}
+
+void reserve_bytes( char **buf, int *buf_capacity, int bytes )
+{
+    if( bytes <= *buf_capacity )
+        return;
+    *buf_capacity = 2 * bytes;
+    *buf = (char*) realloc( *buf, *buf_capacity );
+}
+
+//
+//  ghost positions on the wire
+//
+void pack_position( char *buf, particle_t &p )
+{
+    if( halo_single )
+    {
+        ((float*)buf)[0] = (float)p.x;
+        ((float*)buf)[1] = (float)p.y;
+    }
+    else
+    {
+        ((double*)buf)[0] = p.x;
+        ((double*)buf)[1] = p.y;
+    }
+}
+
+void unpack_position( char *buf, particle_t &p )
+{
+    if( halo_single )
+    {
+        p.x = ((float*)buf)[0];
+        p.y = ((float*)buf)[1];
+    }
+    else
+    {
+        p.x = ((double*)buf)[0];
+        p.y = ((double*)buf)[1];
+    }
+    p.vx = p.vy = p.ax = p.ay = 0;
+}
+
+//
+//  send count particles from send_buf[first..] to dest while receiving
+//  from src into local[at..], together with their global indices.
+//  Returns the number of particles received.
+//
+int shift( int first, int count, int dest, int src, int at )
+{
+    int incoming = 0;
+    MPI_Sendrecv( &count, 1, MPI_INT, dest, 0, &incoming, 1, MPI_INT, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    reserve( at + incoming );
+
+    MPI_Sendrecv( send_buf + first, count, PARTICLE, dest, 1, local + at, incoming, PARTICLE, src, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    MPI_Sendrecv( send_ids + first, count, MPI_INT, dest, 2, local_ids + at, incoming, MPI_INT, src, 2, MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+
+    if( dest != MPI_PROC_NULL )
+    {
+        messages += 3;
+        migration_bytes += count * (sizeof(particle_t) + sizeof(int));
+    }
+    return incoming;
+}
+
+//
+//  same for ghosts: count packed positions from halo_out go to dest,
+//  the ones from src are unpacked into local[at..]
+//
+int shift_positions( int first, int count, int dest, int src, int at )
+{
+    int incoming = 0;
+    MPI_Sendrecv( &count, 1, MPI_INT, dest, 0, &incoming, 1, MPI_INT, src, 0, MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    reserve( at + incoming );
+    reserve_bytes( &halo_in, &halo_in_capacity, incoming * position_size );
+
+    MPI_Sendrecv( halo_out + first * position_size, count, POSITION, dest, 1, halo_in, incoming, POSITION, src, 1, MPI_COMM_WORLD, MPI_STATUS_IGNORE );
+    for( int i = 0; i < incoming; i++ )
+        unpack_position( halo_in + i * position_size, local[at + i] );
+
+    if( dest != MPI_PROC_NULL )
+    {
+        messages += 2;
+        halo_bytes += count * position_size;
+    }
+    return incoming;
+}
+
+//
+//  hand the particles that left the slab over to the neighboring ranks.
+//  Usually a particle moves less than a slab per step and one round is
+//  enough, but a fast one may jump past the slab next to ours, mostly
+//  when the slabs are thin. So the particles that arrive in a slab they
+//  do not belong to are forwarded again, one rank per round, until every
+//  particle is at its owner.
+//
+void migrate( )
+{
+    int away;
+    do
+    {
+        int to_left = 0, to_right = 0, kept = 0;
+
+        /* first pass counts, second fills: leavers to the left first, then to the right */
+        for( int i = 0; i < nlocal; i++ )
+        {
+            int row = bin_row( globalIds[i] );
+            to_left += row < first_row;
+            to_right += row >= last_row;
+        }
+        reserve_send( to_left + to_right );
+
+        int l = 0, r = to_left;
+        for( int i = 0; i < nlocal; i++ )
+        {
+            int row = bin_row( globalIds[i] );
+            if( row < first_row )
+            {
+                send_buf[l] = local[i];
+                send_ids[l++] = local_ids[i];
+            }
+            else if( row >= last_row )
+            {
+                send_buf[r] = local[i];
+                send_ids[r++] = local_ids[i];
+            }
+            else
+            {
+                local[kept] = local[i];
+                globalIds[kept] = globalIds[i];
+                local_ids[kept++] = local_ids[i];
+            }
+        }
+        nlocal = kept;
+
+        nlocal += shift( 0, to_left, left, right, nlocal );
+        nlocal += shift( to_left, to_right, right, left, nlocal );
+
+        /* the arrivals have no bin yet; count the ones that are still not home */
+        int not_home = 0;
+        for( int i = kept; i < nlocal; i++ )
+        {
+            globalIds[i] = bin_of( local[i] );
+            int row = bin_row( globalIds[i] );
+            not_home += row < first_row || row >= last_row;
+        }
+        MPI_Allreduce( &not_home, &away, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
+        messages += allreduce_messages( );
+    }
+    while( away > 0 );
+}
+
+//
+//  copy the k bin rows at each border of the slab to the neighbors,
+//  and receive theirs as ghosts behind the owned particles
+//
+void exchange_ghosts( )
+{
+    int k = cells_per_cutoff;
+    int to_left = 0, to_right = 0;
+
+    for( int i = 0; i < nlocal; i++ )
+    {
+        int row = row_of( local[i] );
+        to_left += row < first_row + k;
+        to_right += row >= last_row - k;
+    }
+    reserve_bytes( &halo_out, &halo_out_capacity, (to_left + to_right) * position_size );
+
+    int l = 0, r = to_left;
+    for( int i = 0; i < nlocal; i++ )
+    {
+        int row = row_of( local[i] );
+        if( row < first_row + k )
+            pack_position( halo_out + (l++) * position_size, local[i] );
+        if( row >= last_row - k )
+            pack_position( halo_out + (r++) * position_size, local[i] );
+    }
+
+    nghost = shift_positions( 0, to_left, left, right, nlocal );
+    nghost += shift_positions( to_left, to_right, right, left, nlocal + nghost );
+}
+
+//
+//  the local bins cover the slab plus k ghost rows on each side, which
+//  are the padding rows of the global grid, so a bin id of the global
+//  grid is first_row rows past the local one
+//
+void rebin( bin_t *bins )
+{
+    int offset = first_row * bin_stride;
+    for( int i = 0; i < nlocal + nghost; i++ )
+        globalIds[i] = bin_of( local[i] ) - offset;
+    insert_into_bins( local, bins, nlocal + nghost );
+}
+
+//
+//  collect all particles on rank 0, in their original order
+//
+void gather( int n, particle_t *particles, particle_t *gathered, int *gathered_ids, int *counts, int *offsets )
+{
+    MPI_Gather( &nlocal, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD );
+    if( rank == 0 )
+        for( int r = 0; r < n_proc; r++ )
+            offsets[r] = r ? offsets[r-1] + counts[r-1] : 0;
+
+    MPI_Gatherv( local, nlocal, PARTICLE, gathered, counts, offsets, PARTICLE, 0, MPI_COMM_WORLD );
+    MPI_Gatherv( local_ids, nlocal, MPI_INT, gathered_ids, counts, offsets, MPI_INT, 0, MPI_COMM_WORLD );
+
+    if( rank == 0 )
+        for( int i = 0; i < n; i++ )
+            particles[gathered_ids[i]] = gathered[i];
+}
+
+//
+//  binary trajectory output with MPI-IO
+//
+typedef struct
+{
+    int id;
+    double x, y;
+} record_t;
+
+int compare_records( const void *a, const void *b )
+{
+    return ((record_t*)a)->id - ((record_t*)b)->id;
+}
+
+MPI_File open_trajectory( char *filename, int n, double size )
+{
+    MPI_File fh;
+    MPI_File_open( MPI_COMM_WORLD, filename, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh );
+    MPI_File_set_size( fh, 0 );
+    if( rank == 0 )
+    {
+        trajectory_header_t header;
+        memset( &header, 0, sizeof(header) );
+        strcpy( header.magic, TRAJECTORY_MAGIC );
+        header.n = n;
+        header.size = size;
+        MPI_File_write_at( fh, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE );
+    }
+    return fh;
+}
+
+//
+//  every rank writes the positions of its own particles into their
+//  slots of the frame. A file view may only list offsets in increasing
+//  order, so the particles are sorted by global index first.
+//
+void save_frame( MPI_File fh, int frame, int n )
+{
+    record_t *records = (record_t*) malloc( nlocal * sizeof(record_t) );
+    int *ids = (int*) malloc( nlocal * sizeof(int) );
+    double *xy = (double*) malloc( 2 * nlocal * sizeof(double) );
+
+    for( int i = 0; i < nlocal; i++ )
+    {
+        records[i].id = local_ids[i];
+        records[i].x = local[i].x;
+        records[i].y = local[i].y;
+    }
+    qsort( records, nlocal, sizeof(record_t), compare_records );
+    for( int i = 0; i < nlocal; i++ )
+    {
+        ids[i] = records[i].id;
+        xy[2*i] = records[i].x;
+        xy[2*i+1] = records[i].y;
+    }
+
+    MPI_Datatype filetype;
+    MPI_Type_create_indexed_block( nlocal, 1, ids, XY, &filetype );
+    MPI_Type_commit( &filetype );
+
+    MPI_Offset frame_start = sizeof(trajectory_header_t) + (MPI_Offset)frame * n * 2 * sizeof(double);
+    MPI_File_set_view( fh, frame_start, XY, filetype, "native", MPI_INFO_NULL );
+    MPI_File_write_at_all( fh, 0, xy, nlocal, XY, MPI_STATUS_IGNORE );
+
+    MPI_Type_free( &filetype );
+    free( records );
+    free( ids );
+    free( xy );
+}
+
+/* a barrier that shows up in the trace */
+void wait_at_barrier( )
+{
+    trace_begin( omp_get_thread_num( ), "barrier" );
+    #pragma omp barrier
+    trace_end( omp_get_thread_num( ) );
+}
+
+/* rank 0 collects the events of all ranks into one trace, one process per rank */
+void write_trace( const char *filename )
+{
+    char process[32], *json;
+    snprintf( process, sizeof(process), "rank %d", rank );
+    int length = trace_format( &json, rank, process );
+    trace_free( );
+
+    int *lengths = NULL, *offsets = NULL, total = 0;
+    char *all = NULL;
+    if( rank == 0 )
+        lengths = (int*) malloc( n_proc * sizeof(int) );
+    MPI_Gather( &length, 1, MPI_INT, lengths, 1, MPI_INT, 0, MPI_COMM_WORLD );
+    if( rank == 0 )
+    {
+        offsets = (int*) malloc( n_proc * sizeof(int) );
+        for( int r = 0; r < n_proc; r++ )
+        {
+            offsets[r] = total;
+            total += lengths[r];
+        }
+        all = (char*) malloc( total );
+    }
+    MPI_Gatherv( json, length, MPI_CHAR, all, lengths, offsets, MPI_CHAR, 0, MPI_COMM_WORLD );
+    if( rank == 0 )
+        trace_write( filename, all, total );
+
+    free( json );
+    free( all );
+    free( lengths );
+    free( offsets );
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    //
+    //  process command line parameters
+    //
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set the number of particles\n" );
+        printf( "-p <int> to set the number of threads per rank (default: OMP_NUM_THREADS)\n" );
+        printf( "-o <filename> to write a binary trajectory with MPI-IO\n" );
+        printf( "-t <filename> to write a text trajectory, gathered on rank 0\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-f to send ghost positions in single precision\n" );
+        printf( "-trace <filename> to write the phases of every thread of every rank as a Chrome trace (ui.perfetto.dev)\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    int n_threads = read_int( argc, argv, "-p", 0 );
+    char *savename = read_string( argc, argv, "-t", NULL );
+    char *binname = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+    halo_single = find_option( argc, argv, "-f" ) >= 0;
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+
+    if( n_threads > 0 )
+        omp_set_num_threads( n_threads );
+
+    //
+    //  set up MPI
+    //
+    int provided;
+    MPI_Init_thread( &argc, &argv, MPI_THREAD_FUNNELED, &provided );
+    MPI_Comm_size( MPI_COMM_WORLD, &n_proc );
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    if( provided < MPI_THREAD_FUNNELED && rank == 0 )
+        printf( "warning: MPI does not support MPI_THREAD_FUNNELED\n" );
+
+    MPI_Type_contiguous( 6, MPI_DOUBLE, &PARTICLE );
+    MPI_Type_commit( &PARTICLE );
+
+    /* ghosts only carry x and y */
+    MPI_Type_contiguous( 2, halo_single ? MPI_FLOAT : MPI_DOUBLE, &POSITION );
+    MPI_Type_commit( &POSITION );
+
+    MPI_Type_contiguous( 2, MPI_DOUBLE, &XY );
+    MPI_Type_commit( &XY );
+    position_size = halo_single ? 2 * sizeof(float) : 2 * sizeof(double);
+
+    //
+    //  set up the slab decomposition
+    //
+    set_size( n, k );
+    first_row = slab_start( rank );
+    last_row = slab_start( rank + 1 );
+    left = rank > 0 ? rank - 1 : MPI_PROC_NULL;
+    right = rank < n_proc - 1 ? rank + 1 : MPI_PROC_NULL;
+
+    /* ghosts must come from the neighboring slab only */
+    if( num_rows / n_proc < k )
+    {
+        if( rank == 0 )
+            printf( "too many ranks: %d bin rows cannot be split into %d slabs of at least %d rows\n", num_rows, n_proc, k );
+        MPI_Finalize( );
+        return 1;
+    }
+
+    /* only this rank's slab and its ghost rows are binned */
+    num_bins = (last_row - first_row + 2 * k) * bin_stride;
+    bin_t *bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+    init_bins( bins );
+
+    //
+    //  every rank initialises a slice of the particles and sends
+    //  each particle to the rank owning its slab
+    //
+    int per_rank = (n + n_proc - 1) / n_proc;
+    int first = min( rank * per_rank, n );
+    int last = min( first + per_rank, n );
+    int count = last - first;
+
+    particle_t *slice = (particle_t*) malloc( count * sizeof(particle_t) );
+    init_particles( n, slice, seed, first, last );
+
+    int *send_counts = (int*) calloc( n_proc, sizeof(int) );
+    int *send_offsets = (int*) malloc( n_proc * sizeof(int) );
+    int *recv_counts = (int*) malloc( n_proc * sizeof(int) );
+    int *recv_offsets = (int*) malloc( n_proc * sizeof(int) );
+
+    for( int i = 0; i < count; i++ )
+        send_counts[owner( row_of( slice[i] ) )]++;
+    for( int r = 0; r < n_proc; r++ )
+        send_offsets[r] = r ? send_offsets[r-1] + send_counts[r-1] : 0;
+
+    reserve_send( count );
+    int *cursor = (int*) malloc( n_proc * sizeof(int) );
+    for( int r = 0; r < n_proc; r++ )
+        cursor[r] = send_offsets[r];
+    for( int i = 0; i < count; i++ )
+    {
+        int r = owner( row_of( slice[i] ) );
+        send_buf[cursor[r]] = slice[i];
+        send_ids[cursor[r]++] = first + i;
+    }
+
+    MPI_Alltoall( send_counts, 1, MPI_INT, recv_counts, 1, MPI_INT, MPI_COMM_WORLD );
+    nlocal = 0;
+    for( int r = 0; r < n_proc; r++ )
+    {
+        recv_offsets[r] = nlocal;
+        nlocal += recv_counts[r];
+    }
+    reserve( nlocal );
+    MPI_Alltoallv( send_buf, send_counts, send_offsets, PARTICLE, local, recv_counts, recv_offsets, PARTICLE, MPI_COMM_WORLD );
+    MPI_Alltoallv( send_ids, send_counts, send_offsets, MPI_INT, local_ids, recv_counts, recv_offsets, MPI_INT, MPI_COMM_WORLD );
+
+    free( slice );
+    free( cursor );
+    free( send_counts );
+    free( send_offsets );
+    free( recv_counts );
+    free( recv_offsets );
+
+    exchange_ghosts( );
+    rebin( bins );
+
+    MPI_File fbin = MPI_FILE_NULL;
+    if( binname )
+        fbin = open_trajectory( binname, n, size );
+
+    //
+    //  rank 0 collects the text frames to save
+    //
+    FILE *fsave = savename && rank == 0 ? fopen( savename, "w" ) : NULL;
+    particle_t *particles = NULL, *gathered = NULL;
+    int *gathered_ids = NULL, *counts = NULL, *offsets = NULL;
+    if( savename && rank == 0 )
+    {
+        particles = (particle_t*) malloc( n * sizeof(particle_t) );
+        gathered = (particle_t*) malloc( n * sizeof(particle_t) );
+        gathered_ids = (int*) malloc( n * sizeof(int) );
+        counts = (int*) malloc( n_proc * sizeof(int) );
+        offsets = (int*) malloc( n_proc * sizeof(int) );
+    }
+
+    //
+    //  simulate a number of time steps
+    //
+    messages = halo_bytes = migration_bytes = 0;
+    if( tracename )
+    {
+        /* the ranks start their clocks together, so that their timelines line up */
+        MPI_Barrier( MPI_COMM_WORLD );
+        trace_init( omp_get_max_threads( ) );
+    }
+    double simulation_time = read_timer( );
+
+    #pragma omp parallel
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        int thread = omp_get_thread_num( );
+
+        //
+        //  compute forces on the particles of the slab's own bins
+        //
+        trace_begin( thread, "force" );
+        #pragma omp for nowait
+        for( int b = k * bin_stride; b < num_bins - k * bin_stride; b++ )
+            go_through_neighbors( local, bins, b );
+        trace_end( thread );
+        wait_at_barrier( );
+
+        //
+        //  move particles
+        //
+        /* one contiguous slice per thread, so that the move vectorizes */
+        int per_thread = (nlocal + omp_get_num_threads() - 1) / omp_get_num_threads();
+        int my_first = min( thread * per_thread, nlocal );
+        trace_begin( thread, "move" );
+        move_particles( local, globalIds, my_first, min( my_first + per_thread, nlocal ) );
+        trace_end( thread );
+        wait_at_barrier( );
+
+        #pragma omp master
+        {
+            trace_begin( thread, "migrate" );
+            migrate( );
+            trace_end( thread );
+            trace_begin( thread, "ghosts" );
+            exchange_ghosts( );
+            trace_end( thread );
+            trace_begin( thread, "rebin" );
+            rebin( bins );
+            trace_end( thread );
+
+#ifdef DEBUG
+            /* checking that the number of particles doesnt change */
+            int total = 0;
+            MPI_Allreduce( &nlocal, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD );
+            assert( total == n );
+#endif
+
+            //
+            //  save if necessary
+            //
+            if( (binname || savename) && (step%SAVEFREQ) == 0 )
+            {
+                trace_begin( thread, "save" );
+                if( binname )
+                    save_frame( fbin, step / SAVEFREQ, n );
+                if( savename )
+                {
+                    gather( n, particles, gathered, gathered_ids, counts, offsets );
+                    if( fsave )
+                        save( fsave, n, particles );
+                }
+                trace_end( thread );
+            }
+        }
+        wait_at_barrier( );
+    }
+    simulation_time = read_timer( ) - simulation_time;
+
+    long long totals[3] = { messages, halo_bytes, migration_bytes }, sums[3];
+    MPI_Reduce( totals, sums, 3, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD );
+
+    if( rank == 0 )
+    {
+        printf( "n = %d, n_procs = %d, n_threads = %d, simulation time = %g seconds\n", n, n_proc, omp_get_max_threads(), simulation_time );
+        printf( "per rank and step: %.1f messages, %.1f KB of ghosts, %.1f KB of migrating particles\n",
+                (double)sums[0] / n_proc / NSTEPS, sums[1] / 1024.0 / n_proc / NSTEPS, sums[2] / 1024.0 / n_proc / NSTEPS );
+    }
+
+    if( tracename )
+        write_trace( tracename );
+
+    //
+    //  release resources
+    //
+    free( local );
+    free( local_ids );
+    free( globalIds );
+    free( send_buf );
+    free( send_ids );
+    free( halo_out );
+    free( halo_in );
+    free( bins );
+    free( particles );
+    free( gathered );
+    free( gathered_ids );
+    free( counts );
+    free( offsets );
+    if( fsave )
+        fclose( fsave );
+
+    if( fbin != MPI_FILE_NULL )
+        MPI_File_close( &fbin );
+
+    MPI_Type_free( &XY );
+    MPI_Type_free( &POSITION );
+    MPI_Type_free( &PARTICLE );
+    MPI_Finalize( );
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*Large-scale particle simulator.
+
+	A memory-lean OpenMP variant meant for runs of up to ~1e9 particles
+	on one large-memory node. At that scale the grid has more than
+	INT_MAX bins, so bin ids are 64-bit. Instead of a bin_t with its own
+	id array per bin, the bins are stored as one array of 32-bit offsets
+	into a single array of particle indices sorted by bin (a counting
+	sort, rebuilt every step). Neighbors are found from the bin's row and
+	column, so no per-bin neighbor lists are kept either.
+
+	Memory budget per particle (density 0.0005, cutoff 0.01, so there
+	are density/cutoff^2 = 5 bins per particle):
+
+		particle_t                   48 bytes
+		bin id (64-bit)               8 bytes
+		sorted particle index         4 bytes
+		bin offsets (5 x 32-bit)     20 bytes
+		------------------------------------
+		total                        80 bytes
+
+	i.e. ~80 GB for n = 1e9. n itself must stay below 2^31.
+
+To run in Linux:
+make -f Makefile_p large
+./large -n 1000000000
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include "common.h"
+
+extern int num_rows;
+int *globalIds;					/* only used by the regular drivers */
+
+long long num_cells;			/* number of bins, may exceed INT_MAX */
+long long *cellIds;				/* bin of every particle */
+unsigned int *cell_offsets;		/* num_cells+2 entries, bin c holds sorted[cell_offsets[c] .. cell_offsets[c+1]) */
+int *sorted;					/* particle indices ordered by bin */
+
+/* bin of a particle, clamped so that a particle exactly on the upper wall stays inside */
+long long cell_of( particle_t &p ) {
+	long long col = (long long)(p.x / cutoff);
+	long long row = (long long)(p.y / cutoff);
+	if (col >= num_rows) col = num_rows - 1;
+	if (row >= num_rows) row = num_rows - 1;
+	return col * num_rows + row;
+}
+
+/* inclusive prefix sum of a[0..len) in parallel: every thread scans
+   its own block, then adds the sum of all blocks before it */
+void prefix_sum( unsigned int *a, long long len ) {
+	int n_threads = omp_get_max_threads();
+	unsigned int *block_sums = (unsigned int*) calloc(n_threads + 1, sizeof(unsigned int));
+
+	#pragma omp parallel num_threads(n_threads)
+	{
+		int t = omp_get_thread_num();
+		long long per_thread = (len + n_threads - 1) / n_threads;
+		long long first = t * per_thread < len ? t * per_thread : len;
+		long long last = first + per_thread < len ? first + per_thread : len;
+
+		unsigned int sum = 0;
+		for (long long i = first; i < last; i++)
+			a[i] = (sum += a[i]);
+		block_sums[t+1] = sum;
+
+		#pragma omp barrier
+		#pragma omp single
+		for (int i = 1; i <= n_threads; i++)
+			block_sums[i] += block_sums[i-1];
+
+		unsigned int offset = block_sums[t];
+		for (long long i = first; i < last; i++)
+			a[i] += offset;
+	}
+	free(block_sums);
+}
+
+/* counting sort of the particles by bin. Bin c is counted in
+   cell_offsets[c+2]; after the scan cell_offsets[c+1] is the start of
+   bin c, and it is used as the fill cursor so that it ends up at the
+   start of bin c+1. The order inside a bin depends on thread timing. */
+void sort_into_cells( int n ) {
+	#pragma omp parallel for
+	for (long long c = 0; c < num_cells + 2; c++)
+		cell_offsets[c] = 0;
+
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++) {
+		#pragma omp atomic
+		cell_offsets[cellIds[i] + 2]++;
+	}
+
+	prefix_sum(cell_offsets, num_cells + 2);
+
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++) {
+		unsigned int slot;
+		#pragma omp atomic capture
+		slot = cell_offsets[cellIds[i] + 1]++;
+		sorted[slot] = i;
+	}
+}
+
+/* apply the force from every particle in the 3x3 bins around particle i */
+void compute_force( particle_t *particles, int i ) {
+	particle_t &p = particles[i];
+	long long col = cellIds[i] / num_rows;
+	long long row = cellIds[i] % num_rows;
+
+	p.ax = p.ay = 0;
+	for (long long c = col - 1; c <= col + 1; c++) {
+		if (c < 0 || c >= num_rows)
+			continue;
+		long long first_cell = c * num_rows + (row > 0 ? row - 1 : 0);
+		long long last_cell = c * num_rows + (row < num_rows - 1 ? row + 1 : row);
+		/* the bins of one column are contiguous in the sorted array */
+		for (unsigned int j = cell_offsets[first_cell]; j < cell_offsets[last_cell + 1]; j++)
+			apply_force(p, particles[sorted[j]]);
+	}
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set number of particles\n" );
+        printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    char *savename = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+
+    FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
+
+    set_box( n, 1 );
+	num_cells = (long long)num_rows * num_rows;
+
+    particle_t *particles = (particle_t*) malloc( (size_t)n * sizeof(particle_t) );
+	cellIds = (long long*) malloc( (size_t)n * sizeof(long long) );
+	sorted = (int*) malloc( (size_t)n * sizeof(int) );
+	cell_offsets = (unsigned int*) malloc( (num_cells + 2) * sizeof(unsigned int) );
+	if( !particles || !cellIds || !sorted || !cell_offsets )
+	{
+		printf( "failed to allocate memory for %d particles (%lld bins)\n", n, num_cells );
+		return 1;
+	}
+
+	#pragma omp parallel
+	{
+		int per_thread = (n + omp_get_num_threads() - 1) / omp_get_num_threads();
+		int first = min( omp_get_thread_num() * per_thread, n );
+		int last = min( first + per_thread, n );
+		init_particles( n, particles + first, seed, first, last );
+		for( int i = first; i < last; i++ )
+			cellIds[i] = cell_of( particles[i] );
+	}
+
+	sort_into_cells( n );
+
+    //
+    //  simulate a number of time steps
+    //
+    double simulation_time = read_timer( );
+
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        //
+        //  compute all forces
+        //
+		/* bin order, so neighboring particles are computed close together in time */
+		#pragma omp parallel for schedule(dynamic, 1024)
+        for( int i = 0; i < n; i++ )
+			compute_force( particles, sorted[i] );
+
+        //
+        //  move particles
+        //
+		#pragma omp parallel for
+		for( int i = 0; i < n; i++ )
+		{
+			move( particles[i] );
+			cellIds[i] = cell_of( particles[i] );
+		}
+
+		sort_into_cells( n );
+
+#ifdef DEBUG
+		assert( cell_offsets[num_cells] == (unsigned int)n );
+#endif
+
+        //
+        //  save if necessary
+        //
+        if( fsave && (step%SAVEFREQ) == 0 )
+            save( fsave, n, particles );
+    }
+    simulation_time = read_timer( ) - simulation_time;
+
+    printf( "n = %d, n_threads = %d, simulation time = %g seconds\n", n, omp_get_max_threads(), simulation_time );
+
+    free( particles );
+    free( cellIds );
+    free( sorted );
+    free( cell_offsets );
+    if( fsave )
+        fclose( fsave );
+
+    return 0;
+}
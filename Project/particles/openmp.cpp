@@ -10,12 +10,29 @@ make -f Makefile_p openmp
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 #include <omp.h>
 #include "common.h"
+#include "telemetry.h"
+#include "trace.h"
 
 int n_threads;
 extern int num_bins, num_rows; 
 int *globalIds; 
+
+/* how the force sweep over the bins is shared among the threads */
+#define SCHEDULE_STATIC   0		/* equal numbers of bins */
+#define SCHEDULE_DYNAMIC  1		/* chunks of bins handed out on demand */
+#define SCHEDULE_WEIGHTED 2		/* equal estimated work, see split_bins_by_cost */
+
+/* a barrier that shows up in the trace */
+void wait_at_barrier( )
+{
+	trace_begin( omp_get_thread_num( ), "barrier" );
+	#pragma omp barrier
+	trace_end( omp_get_thread_num( ) );
+}
+
 //
 //  benchmarking program
 //
@@ -28,34 +45,104 @@ int main( int argc, char **argv )
         printf( "-n <int> to set number of particles\n" );
         printf( "-p <int> to set the number of threads\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-inc <int> to only move particles that change bin, rebuilding all bins when more than <int>%% of them do\n" );
+        printf( "-hash to keep only the occupied bins, in a hash table\n" );
+        printf( "-tel <name> to publish per-step timings to the telemetry viewer\n" );
+        printf( "-order <int> to sweep the bins in 0: row-major, 1: Z-order, 2: L2-sized tiles (default: 0)\n" );
+        printf( "-live <name> to stream the positions to \"visualize -live <name>\" while running\n" );
+        printf( "-sym to compute every pair once, for both particles, over a 2x2 checkerboard of bin blocks\n" );
+        printf( "-arena <int> to keep all simulation state in one arena on 0: 4K pages, 1: transparent huge pages, 2: explicit huge pages\n" );
+        printf( "-load <int> to report the bin occupancy and the force time of every thread every <int> steps\n" );
+        printf( "-trace <filename> to write the phases of every thread as a Chrome trace (ui.perfetto.dev)\n" );
+        printf( "-sched <int> to split the force sweep in 0: equal bins, 1: dynamic chunks, 2: equal estimated work (default: 0, ignored with -sym)\n" );
         return 0;
     }
 
     int n = read_int( argc, argv, "-n", 1000 );
     n_threads = read_int( argc, argv, "-p", 2 );
     char *savename = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+    int use_hash = find_option( argc, argv, "-hash" ) >= 0;
+    int rebuild_percent = read_int( argc, argv, "-inc", 100 );
+    char *telname = read_string( argc, argv, "-tel", NULL );
+    char *livename = read_string( argc, argv, "-live", NULL );
+    int order_mode = read_int( argc, argv, "-order", ORDER_ROWS );
+    int arena_pages = read_int( argc, argv, "-arena", -1 );
+    int symmetric = find_option( argc, argv, "-sym" ) >= 0 && !use_hash;
+    int load_every = read_int( argc, argv, "-load", 0 );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    int schedule = read_int( argc, argv, "-sched", SCHEDULE_STATIC );
 
     FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
 
-    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
-    set_size( n );
-	globalIds =  (int*) malloc(n * sizeof(int));
-    init_particles( n, particles );
+    set_size( n, k );
+    if( arena_pages >= 0 )
+        init_arena( n, arena_pages );
+    particle_t *particles = (particle_t*) sim_malloc( n * sizeof(particle_t) );
+	globalIds =  (int*) sim_malloc(n * sizeof(int));
+	int *newIds = find_option( argc, argv, "-inc" ) >= 0 && !use_hash ? (int*) sim_malloc(n * sizeof(int)) : NULL;
+	long long movers = 0;
+
+    /* every thread initialises its own slice; the result does not depend on the thread count */
+	#pragma omp parallel
+	{
+		int per_thread = (n + omp_get_num_threads() - 1) / omp_get_num_threads();
+		int first = min( omp_get_thread_num() * per_thread, n );
+		int last = min( first + per_thread, n );
+		init_particles( n, particles + first, seed, first, last );
+	}
     
-    bin_t *bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
-	
-	/* make room for up to n particles per bin */
-	for(int i = 0; i < num_bins; i++)
-		bins[i].particle_ids = (int*) malloc(n*sizeof(int));
+    bin_t *bins = NULL;
+    hash_grid_t grid;
 
-	/* initialise the bins */
-    init_bins(bins);
+	if( use_hash ) {
+		/* memory and sweep cost follow the occupied cells, not the box area */
+		init_hash_grid(&grid, n);
+		insert_into_hash_grid(particles, &grid, n);
+	} else {
+	    bins = (bin_t*) sim_malloc( num_bins * sizeof(bin_t) );
+		
+		/* initialise the bins */
+	    init_bins(bins);
+
+		#pragma omp parallel for
+		for(int i = 0; i < n; i++)
+			globalIds[i] = bin_of(particles[i]);
+
+		/* insert particles into the bins */
+	  	insert_into_bins( particles, bins, n );
+	}
+	int *order = NULL;
+	if( bins && order_mode != ORDER_ROWS ) {
+		order = (int*) sim_malloc( num_bins * sizeof(int) );
+		init_bin_order( order, order_mode, n );
+	}
 
-	for(int i = 0; i < n; i++)
-		globalIds[i] = (int)(floor(particles[i].x / cutoff) * num_rows + floor(particles[i].y / cutoff));
+	/* the static and dynamic splits come from the runtime schedule of the force loop */
+	if( schedule == SCHEDULE_DYNAMIC )
+		omp_set_schedule( omp_sched_dynamic, 64 );
+	else
+		omp_set_schedule( omp_sched_static, 0 );
+	int parts = omp_get_max_threads( );
+	long long *cost_prefix = NULL;
+	int *first_bin = NULL;			/* thread ranges of the weighted split, updated after every rebin */
+	/* -sym sweeps colored blocks, which have their own dynamic schedule */
+	if( bins && schedule == SCHEDULE_WEIGHTED && !symmetric ) {
+		cost_prefix = (long long*) sim_malloc( (num_bins + 1) * sizeof(long long) );
+		first_bin = (int*) sim_malloc( (parts + 1) * sizeof(int) );
+		split_bins_by_cost( bins, order, parts, cost_prefix, first_bin );
+	}
 
-	/* insert particles into the bins */
-  	insert_into_bins( particles, bins, n );
+    telemetry_t *telemetry = telname ? telemetry_create( telname, n, omp_get_max_threads( ) ) : NULL;
+    live_header_t *live = livename ? live_create( livename, n ) : NULL;
+    double marks[NUM_PHASES+1];		/* only touched by the master thread */
+    load_t load;
+    load_init( &load, load_every, omp_get_max_threads( ) );
+    if( tracename )
+        trace_init( omp_get_max_threads( ) );
 
     //
     //  simulate a number of time steps
@@ -65,28 +152,130 @@ int main( int argc, char **argv )
 	#pragma omp parallel
     for( int step = 0; step < 1000; step++ )
     {
+        int thread = omp_get_thread_num( );
+
+        #pragma omp master
+        marks[PHASE_FORCE] = read_timer( );
+
         //
         //  compute all forces
         //
-        #pragma omp for
+        trace_begin( thread, "zero" );
+        #pragma omp for nowait
         for( int i = 0; i < n; i++ )
             particles[i].ax = particles[i].ay = 0;
+        trace_end( thread );
+        wait_at_barrier( );
 
-		#pragma omp for
-        for (int i = 0; i < num_bins; i++)
-			go_through_neighbors(particles, bins, i);
-        
-        //
-        //  move particles
-        //
-		#pragma omp for
-		for (int i = 0; i < n; i++) 
-            move_and_update( particles[i], i, globalIds[i]);		
+		/* on sampled steps every thread times its own part of the sweep, before the barrier */
+		int sampled = load_sampled( &load, step );
+		double start;
+
+		if( use_hash ) {
+			start = read_timer( );
+			trace_begin( thread, "force" );
+			#pragma omp for nowait
+			for (int i = 0; i < grid.num_cells; i++)
+				go_through_neighbors(particles, &grid, i);
+			trace_end( thread );
+			if( sampled )
+				load.busy[thread] += read_timer( ) - start;
+			wait_at_barrier( );
+
+			#pragma omp master
+			{
+			marks[PHASE_MOVE] = read_timer( );
+			if( sampled )
+				load_report( &load, step, &grid );
+			}
+
+			trace_begin( thread, "move" );
+			#pragma omp for nowait
+			for (int i = 0; i < n; i++)
+				move( particles[i] );
+			trace_end( thread );
+			wait_at_barrier( );
+
+			#pragma omp master
+			{
+			marks[PHASE_REBIN] = read_timer( );
+			trace_begin( thread, "rebin" );
+			insert_into_hash_grid(particles, &grid, n);
+			trace_end( thread );
+			}
+		} else {
+			if( symmetric ) {
+				/* blocks of one color never share a particle; the barrier separates the colors */
+				for (int color = 0; color < 4; color++) {
+					start = read_timer( );
+					trace_begin( thread, "force" );
+					#pragma omp for schedule(dynamic) nowait
+					for (int j = 0; j < num_colored_blocks(color); j++)
+						go_through_block_symmetric(particles, bins, color, j);
+					trace_end( thread );
+					if( sampled )
+						load.busy[thread] += read_timer( ) - start;
+					wait_at_barrier( );
+				}
+			} else {
+				start = read_timer( );
+				trace_begin( thread, "force" );
+				if( first_bin ) {
+					for (int p = thread; p < parts; p += omp_get_num_threads())
+						for (int i = first_bin[p]; i < first_bin[p+1]; i++)
+							go_through_neighbors(particles, bins, order ? order[i] : i);
+				} else {
+					#pragma omp for schedule(runtime) nowait
+			        for (int i = 0; i < num_bins; i++)
+						go_through_neighbors(particles, bins, order ? order[i] : i);
+				}
+				trace_end( thread );
+				if( sampled )
+					load.busy[thread] += read_timer( ) - start;
+				wait_at_barrier( );
+			}
+
+			#pragma omp master
+			{
+			marks[PHASE_MOVE] = read_timer( );
+			if( sampled )
+				load_report( &load, step, bins );
+			}
+	        
+	        //
+	        //  move particles
+	        //
+			/* one contiguous slice per thread, so that the move vectorizes */
+			int per_thread = (n + omp_get_num_threads() - 1) / omp_get_num_threads();
+			int first = min( thread * per_thread, n );
+			trace_begin( thread, "move" );
+			move_particles( particles, newIds ? newIds : globalIds, first, min( first + per_thread, n ) );
+			trace_end( thread );
+			wait_at_barrier( );
+			
+			#pragma omp master
+			{
+			marks[PHASE_REBIN] = read_timer( );
+			trace_begin( thread, "rebin" );
+			if( newIds )
+				movers += update_bins(particles, bins, n, newIds, rebuild_percent / 100.0);
+			else
+				insert_into_bins(particles, bins, n);
+			if( first_bin )
+				split_bins_by_cost( bins, order, parts, cost_prefix, first_bin );
+			trace_end( thread );
+			}
+		}
 		
+		wait_at_barrier( );
+
 		#pragma omp master
-		insert_into_bins(particles, bins, n);
-		
-		#pragma omp barrier
+		if( telemetry )
+		{
+			marks[NUM_PHASES] = read_timer( );
+			telemetry_publish( telemetry, step, marks, step % SAVEFREQ ? -1 :
+				use_hash ? max_occupancy( &grid ) : max_occupancy( bins ) );
+		}
 		
 
 #ifdef DEBUG
@@ -94,8 +283,12 @@ int main( int argc, char **argv )
 		{
 		/* checking that the number of particles doesnt change */
         int numparticles = 0;
-        for(int i = 0; i < num_bins; i++)
-        	numparticles += bins[i].num_particles;
+        if( use_hash )
+	        for(int i = 0; i < grid.num_cells; i++)
+	        	numparticles += grid.cells[i].num_particles;
+        else
+	        for(int i = 0; i < num_bins; i++)
+	        	numparticles += bins[i].num_particles;
         assert(numparticles==n);
         }
 #endif 
@@ -104,16 +297,36 @@ int main( int argc, char **argv )
         //  save if necessary
         //
         #pragma omp master
-        if( fsave && (step%SAVEFREQ) == 0 )
-            save( fsave, n, particles );
+        if( (fsave || live) && (step%SAVEFREQ) == 0 )
+        {
+            trace_begin( thread, "save" );
+            if( fsave )
+                save( fsave, n, particles );
+            if( live )
+                live_publish( live, particles );
+            trace_end( thread );
+        }
     }
     simulation_time = read_timer( ) - simulation_time;
     
     printf( "n = %d, n_threads = %d, simulation time = %g seconds\n", n, n_threads, simulation_time );
+    if( use_hash )
+        printf( "k = %d, occupied bins = %d of %lld\n", k, grid.num_cells, (long long)num_rows * num_rows );
+    else
+        printf( "k = %d, pairs within cutoff = %.1f%%\n", k, 100 * pair_hit_rate( particles, bins ) );
+    if( newIds )
+        printf( "particles changing bin per step = %.2f%%\n", 100.0 * movers / ((double)n * NSTEPS) );
+    load_summary( &load );
+    if( tracename )
+        trace_finish( tracename, "openmp" );
     
-    free( particles );
-    free( globalIds );
-    free( bins );
+    sim_free( particles );
+    sim_free( globalIds );
+    sim_free( bins );
+    if( telemetry )
+        telemetry_close( telemetry, telname );
+    if( live )
+        live_close( live, livename );
     if( fsave )
         fclose( fsave );
     
@@ -0,0 +1,211 @@
+/*Particle simulator with an OpenMP task graph.
+
+	openmp.cpp separates every phase of every step with a barrier, so the
+	slowest thread gates all of them. Here the bin rows are grouped into
+	blocks of at least k rows, and every step has three tasks per block:
+
+	  F(b) forces on the particles in block b, which reads the
+	       positions in blocks b-1..b+1
+	  M(b) move the particles in block b, once F(b-1..b+1) no longer
+	       need their old positions
+	  R(b) rebuild block b of the other bin set from the moved particles
+	       of blocks b-1..b+1
+
+	So a particle may move at most one block per step. A faster one
+	would be lost from the bins; M stops the run instead, and a larger
+	-b allows faster particles.
+
+	The bins are double buffered: step s reads bin set s%2 and R builds
+	set (s+1)%2. Tasks only depend on their neighbor blocks, so block b
+	can start the forces of the next step as soon as blocks b-1..b+1 are
+	rebuilt, while other blocks are still busy with the previous step.
+	There is no global barrier, except when a frame is saved.
+
+To run in Linux:
+make -f Makefile_p openmp_tasks
+./openmp_tasks
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <omp.h>
+#include "common.h"
+
+extern int num_bins, num_rows, bin_stride, cells_per_cutoff;
+int *globalIds;
+
+int rows_per_block, num_blocks;
+
+/* the bins of block b are [first_bin(b), first_bin(b+1)), whole rows of the padded grid */
+int first_bin( int b ) { return (min( b * rows_per_block, num_rows ) + cells_per_cutoff) * bin_stride; }
+int block_of( int binId ) { return bin_row( binId ) / rows_per_block; }
+
+void forces( particle_t *particles, bin_t *bins, int b )
+{
+    for( int i = first_bin( b ); i < first_bin( b + 1 ); i++ )
+        go_through_neighbors( particles, bins, i );
+}
+
+void moves( particle_t *particles, bin_t *bins, int b )
+{
+    for( int i = first_bin( b ); i < first_bin( b + 1 ); i++ )
+        for( int j = 0; j < bins[i].num_particles; j++ )
+        {
+            int id = bins[i].particle_ids[j];
+            move_and_update( particles[id], id, globalIds[id] );
+
+            int to = block_of( globalIds[id] );
+            if( to < b - 1 || to > b + 1 )
+            {
+                printf( "particle %d moved from block %d to block %d in one step, use a larger -b\n", id, b, to );
+                exit( 1 );
+            }
+        }
+}
+
+/* fill block b of next with the particles of blocks b-1..b+1 of current that now belong to it */
+void rebin( bin_t *current, bin_t *next, int b )
+{
+    for( int i = first_bin( b ); i < first_bin( b + 1 ); i++ )
+        next[i].num_particles = 0;
+
+    for( int i = first_bin( max( b - 1, 0 ) ); i < first_bin( min( b + 2, num_blocks ) ); i++ )
+        for( int j = 0; j < current[i].num_particles; j++ )
+        {
+            int id = current[i].particle_ids[j];
+            if( block_of( globalIds[id] ) == b )
+                add_to_bin( &next[globalIds[id]], id );
+        }
+}
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set number of particles\n" );
+        printf( "-p <int> to set the number of threads (default: OMP_NUM_THREADS)\n" );
+        printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-b <int> to set the number of bin rows per task (default: 4, at least k)\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    int n_threads = read_int( argc, argv, "-p", 0 );
+    char *savename = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+    rows_per_block = max( read_int( argc, argv, "-b", 4 ), k );
+
+    if( n_threads > 0 )
+        omp_set_num_threads( n_threads );
+
+    FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
+
+    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
+    set_size( n, k );
+    globalIds = (int*) malloc( n * sizeof(int) );
+    num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+
+    #pragma omp parallel
+    {
+        int per_thread = (n + omp_get_num_threads() - 1) / omp_get_num_threads();
+        int first = min( omp_get_thread_num() * per_thread, n );
+        int last = min( first + per_thread, n );
+        init_particles( n, particles + first, seed, first, last );
+        for( int i = first; i < last; i++ )
+            globalIds[i] = bin_of( particles[i] );
+    }
+
+    bin_t *bins[2];
+    for( int s = 0; s < 2; s++ )
+    {
+        bins[s] = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+        init_bins( bins[s] );
+    }
+    insert_into_bins( particles, bins[0], n );
+
+    /* placeholders that only carry the task dependencies of every block */
+    char *forced = (char*) malloc( num_blocks );
+    char *moved = (char*) malloc( num_blocks );
+    char *binned = (char*) malloc( num_blocks );
+
+    //
+    //  simulate a number of time steps
+    //
+    double simulation_time = read_timer( );
+
+    #pragma omp parallel
+    #pragma omp single
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        bin_t *current = bins[step % 2], *next = bins[(step + 1) % 2];
+
+        for( int b = 0; b < num_blocks; b++ )
+        {
+            int l = max( b - 1, 0 ), r = min( b + 1, num_blocks - 1 );
+
+            #pragma omp task depend(in: binned[l], binned[b], binned[r]) depend(out: forced[b])
+            forces( particles, current, b );
+        }
+
+        for( int b = 0; b < num_blocks; b++ )
+        {
+            int l = max( b - 1, 0 ), r = min( b + 1, num_blocks - 1 );
+
+            #pragma omp task depend(in: forced[l], forced[b], forced[r]) depend(out: moved[b])
+            moves( particles, current, b );
+        }
+
+        for( int b = 0; b < num_blocks; b++ )
+        {
+            int l = max( b - 1, 0 ), r = min( b + 1, num_blocks - 1 );
+
+            #pragma omp task depend(in: moved[l], moved[b], moved[r]) depend(out: binned[b])
+            rebin( current, next, b );
+        }
+
+        //
+        //  save if necessary
+        //
+        if( fsave && (step%SAVEFREQ) == 0 )
+        {
+            #pragma omp taskwait
+            save( fsave, n, particles );
+        }
+    }
+    simulation_time = read_timer( ) - simulation_time;
+
+#ifdef DEBUG
+    /* checking that the number of particles doesnt change */
+    int numparticles = 0;
+    for( int i = 0; i < num_bins; i++ )
+        numparticles += bins[NSTEPS % 2][i].num_particles;
+    assert( numparticles == n );
+#endif
+
+    printf( "n = %d, n_threads = %d, simulation time = %g seconds\n", n, omp_get_max_threads(), simulation_time );
+    printf( "k = %d, pairs within cutoff = %.1f%%\n", k, 100 * pair_hit_rate( particles, bins[NSTEPS % 2] ) );
+
+    free( particles );
+    free( globalIds );
+    free( bins[0] );
+    free( bins[1] );
+    free( forced );
+    free( moved );
+    free( binned );
+    if( fsave )
+        fclose( fsave );
+
+    return 0;
+}
@@ -11,26 +11,66 @@ make -f Makefile_p pthreads
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
+#include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include "common.h"
+#include "telemetry.h"
+#include "trace.h"
 
 //
 //  global variables
 //
-int n, n_threads;
+int n, n_threads, seed;
 particle_t *particles;
 bin_t *bins;
 FILE *fsave;
 pthread_barrier_t barrier;
-extern int num_bins, num_rows; 
+extern int num_bins, num_rows, bin_stride, cells_per_cutoff; 
 
 int *globalIds; 
+int *newIds;				/* only with -inc: bins after the move, see update_bins */
+int rebuild_percent;
+long long movers;
+int symmetric;				/* -sym, see go_through_block_symmetric */
+telemetry_t *telemetry;		/* only with -tel */
+live_header_t *live;		/* only with -live */
+double marks[NUM_PHASES+1];	/* only touched by thread 0 */
+load_t load;				/* only with -load */
+int pipelined;				/* -pipe, see pipeline_routine */
 
 //
 //  check that pthreads routine call was successful
 //
 #define P( condition ) {if( (condition) != 0 ) { printf( "\n FAILURE in %s, line %d\n", __FILE__, __LINE__ );exit( 1 );}}
 
+//
+//  every thread initialises its own slice of the particles
+//
+void *init_routine( void *pthread_id )
+{
+    int thread_id = *(int*)pthread_id;
+
+    int particles_per_thread = (n + n_threads - 1) / n_threads;
+    int first = min(  thread_id    * particles_per_thread, n );
+    int last  = min( (thread_id+1) * particles_per_thread, n );
+
+    init_particles( n, particles + first, seed, first, last );
+    for( int i = first; i < last; i++ )
+        globalIds[i] = bin_of(particles[i]);
+
+    return NULL;
+}
+
+/* a barrier wait that shows up in the trace */
+void wait_at_barrier( int thread_id )
+{
+    trace_begin( thread_id, "barrier" );
+    pthread_barrier_wait( &barrier );
+    trace_end( thread_id );
+}
+
 //
 //  This is where the action happens
 //
@@ -46,30 +86,80 @@ void *thread_routine( void *pthread_id )
     //
     for( int step = 0; step < NSTEPS; step++ )
     {
+        if( thread_id == 0 )
+            marks[PHASE_FORCE] = read_timer( );
+
         //
         //  compute forces
         //
+        /* on sampled steps every thread times its own part of the sweep, before the barrier */
+        int sampled = load_sampled( &load, step );
+        double start = read_timer( );
+        trace_begin( thread_id, "force" );
         for( int i = first; i < last; i++ )
             particles[i].ax = particles[i].ay = 0;
 
-        for (int i = 0; i < num_bins; i++)
-			go_through_neighbors(particles, bins, first, last, i);
+        if( symmetric )
+        {
+            /* a thread updates particles of other slices too, so all of them must be zeroed first */
+            trace_end( thread_id );
+            wait_at_barrier( thread_id );
+            for( int color = 0; color < 4; color++ )
+            {
+                start = read_timer( );
+                trace_begin( thread_id, "force" );
+                for( int j = thread_id; j < num_colored_blocks( color ); j += n_threads )
+                    go_through_block_symmetric( particles, bins, color, j );
+                trace_end( thread_id );
+                if( sampled )
+                    load.busy[thread_id] += read_timer( ) - start;
+                wait_at_barrier( thread_id );
+            }
+        }
+        else
+        {
+            for (int i = 0; i < num_bins; i++)
+                go_through_neighbors(particles, bins, first, last, i);
+            trace_end( thread_id );
+            if( sampled )
+                load.busy[thread_id] += read_timer( ) - start;
+        }
+
+        wait_at_barrier( thread_id );
 
-        pthread_barrier_wait( &barrier );
+        if( thread_id == 0 )
+        {
+            marks[PHASE_MOVE] = read_timer( );
+            if( sampled )
+                load_report( &load, step, bins );
+        }
 
         //
         //  move particles
         //particles_per_thread
-		for (int i = first; i < last; i++) 
-            move_and_update( particles[i], i, globalIds[i] );		
+		trace_begin( thread_id, "move" );
+		move_particles( particles, newIds ? newIds : globalIds, first, last );
+		trace_end( thread_id );
 				
-        pthread_barrier_wait( &barrier );        
+        wait_at_barrier( thread_id );        
 
 		if(thread_id==0){
-			insert_into_bins(particles, bins, n);
+			marks[PHASE_REBIN] = read_timer( );
+			trace_begin( thread_id, "rebin" );
+			if( newIds )
+				movers += update_bins(particles, bins, n, newIds, rebuild_percent / 100.0);
+			else
+				insert_into_bins(particles, bins, n);
+			trace_end( thread_id );
         }
                 
-        pthread_barrier_wait( &barrier );        
+        wait_at_barrier( thread_id );        
+
+        if( thread_id == 0 && telemetry )
+        {
+            marks[NUM_PHASES] = read_timer( );
+            telemetry_publish( telemetry, step, marks, step % SAVEFREQ ? -1 : max_occupancy( bins ) );
+        }
         
 #ifdef DEBUG
 		/* checking that the number of particles doesnt change */
@@ -82,13 +172,183 @@ void *thread_routine( void *pthread_id )
         //
         //  save if necessary
         //
-        if( thread_id == 0 && fsave && (step%SAVEFREQ) == 0 )
-            save( fsave, n, particles );
+        if( thread_id == 0 && (fsave || live) && (step%SAVEFREQ) == 0 )
+        {
+            trace_begin( thread_id, "save" );
+            if( fsave )
+                save( fsave, n, particles );
+            if( live )
+                live_publish( live, particles );
+            trace_end( thread_id );
+        }
     }
     
     return NULL;
 }
 
+//
+//  pipelined steps (-pipe). The bin rows are grouped into blocks of at
+//  least k rows and every thread owns a contiguous range of blocks. The
+//  three phases of a block follow the task graph of openmp_tasks.cpp:
+//
+//    forces of block b  once blocks b-1..b+1 are rebinned for this step
+//    move of block b    once blocks b-1..b+1 no longer need the old positions;
+//                       the particles that stay in block b go straight into
+//                       block b of the other bin set, the others into a list
+//                       of leavers of block b
+//    rebin of block b   once blocks b-1..b+1 are moved; it adds the leavers
+//                       of blocks b-1 and b+1 that now belong to block b
+//
+//  So a particle may move at most one block per step. A faster one would
+//  be lost from the bins; the move stops the run instead, and a larger
+//  -b allows faster particles.
+//
+//  The bins are double buffered: step s reads set s%2 and builds set
+//  (s+1)%2. Instead of barriers every block counts the steps each phase
+//  has finished, and a phase only waits for the counters of its neighbor
+//  blocks. So the rebin runs on all threads, and a thread whose rows are
+//  rebinned starts the forces of the next step while the others are
+//  still moving and rebinning theirs. The barrier is only kept around
+//  the steps that are saved.
+//
+#define PIPE_FORCE 0
+#define PIPE_MOVE  1
+#define PIPE_REBIN 2
+
+/* the steps every phase of a block has finished, a cache line per block; only its owner writes them */
+typedef struct{
+    int steps[3];
+    char pad[64 - 3 * sizeof(int)];
+} progress_t;
+
+int rows_per_block, num_blocks;
+progress_t *progress;
+bin_t *bin_sets[2];
+bin_t *leavers;				/* per block, the particles that moved out of it this step */
+
+/* the bins of block b are [first_bin(b), first_bin(b+1)), whole rows of the padded grid */
+int first_bin( int b ) { return (min( b * rows_per_block, num_rows ) + cells_per_cutoff) * bin_stride; }
+int block_of( int binId ) { return bin_row( binId ) / rows_per_block; }
+
+/* wait until phase has finished the given number of steps in blocks b-1..b+1 */
+void wait_for( int thread_id, int phase, int b, int steps )
+{
+    for( int i = max( b - 1, 0 ); i <= min( b + 1, num_blocks - 1 ); i++ )
+        if( __atomic_load_n( &progress[i].steps[phase], __ATOMIC_ACQUIRE ) < steps )
+        {
+            trace_begin( thread_id, "wait" );
+            while( __atomic_load_n( &progress[i].steps[phase], __ATOMIC_ACQUIRE ) < steps )
+                sched_yield( );
+            trace_end( thread_id );
+        }
+}
+
+void finish( int phase, int b, int steps )
+{
+    __atomic_store_n( &progress[b].steps[phase], steps, __ATOMIC_RELEASE );
+}
+
+/* move the particles of block b, binning them into next or the leavers of b.
+   Block b of next was last read in the previous step, by phases that the
+   forces of blocks b-1..b+1 have waited for */
+void move_block( bin_t *current, bin_t *next, int b )
+{
+    int first = first_bin( b ), last = first_bin( b + 1 );
+    for( int i = first; i < last; i++ )
+        next[i].num_particles = 0;
+    leavers[b].num_particles = 0;
+
+    for( int i = first; i < last; i++ )
+        for( int j = 0; j < current[i].num_particles; j++ )
+        {
+            int id = current[i].particle_ids[j];
+            move_and_update( particles[id], id, globalIds[id] );
+
+            int to = block_of( globalIds[id] );
+            if( to < b - 1 || to > b + 1 )
+            {
+                printf( "particle %d moved from block %d to block %d in one step, use a larger -b\n", id, b, to );
+                exit( 1 );
+            }
+            add_to_bin( to == b ? &next[globalIds[id]] : &leavers[b], id );
+        }
+}
+
+/* add the leavers of blocks b-1 and b+1 that moved into block b */
+void rebin_block( bin_t *next, int b )
+{
+    for( int from = b - 1; from <= b + 1; from += 2 )
+        if( from >= 0 && from < num_blocks )
+            for( int j = 0; j < leavers[from].num_particles; j++ )
+            {
+                int id = leavers[from].particle_ids[j];
+                if( block_of( globalIds[id] ) == b )
+                    add_to_bin( &next[globalIds[id]], id );
+            }
+}
+
+void *pipeline_routine( void *pthread_id )
+{
+    int thread_id = *(int*)pthread_id;
+
+    int first = num_blocks * thread_id / n_threads;
+    int last  = num_blocks * (thread_id + 1) / n_threads;
+
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        bin_t *current = bin_sets[step % 2], *next = bin_sets[(step + 1) % 2];
+
+        for( int b = first; b < last; b++ )
+        {
+            wait_for( thread_id, PIPE_REBIN, b, step );
+            trace_begin( thread_id, "force" );
+            for( int i = first_bin( b ); i < first_bin( b + 1 ); i++ )
+                go_through_neighbors( particles, current, i );
+            trace_end( thread_id );
+            finish( PIPE_FORCE, b, step + 1 );
+        }
+
+        /* move_and_update zeroes the accelerations for the next step */
+        for( int b = first; b < last; b++ )
+        {
+            wait_for( thread_id, PIPE_FORCE, b, step + 1 );
+            trace_begin( thread_id, "move" );
+            move_block( current, next, b );
+            trace_end( thread_id );
+            finish( PIPE_MOVE, b, step + 1 );
+        }
+
+        for( int b = first; b < last; b++ )
+        {
+            wait_for( thread_id, PIPE_MOVE, b, step + 1 );
+            trace_begin( thread_id, "rebin" );
+            rebin_block( next, b );
+            trace_end( thread_id );
+            finish( PIPE_REBIN, b, step + 1 );
+        }
+
+        //
+        //  save if necessary, once every block has moved and before any moves again
+        //
+        if( (fsave || live) && (step%SAVEFREQ) == 0 )
+        {
+            wait_at_barrier( thread_id );
+            if( thread_id == 0 )
+            {
+                trace_begin( thread_id, "save" );
+                if( fsave )
+                    save( fsave, n, particles );
+                if( live )
+                    live_publish( live, particles );
+                trace_end( thread_id );
+            }
+            wait_at_barrier( thread_id );
+        }
+    }
+
+    return NULL;
+}
+
 //
 //  benchmarking program
 //
@@ -104,39 +364,54 @@ int main( int argc, char **argv )
         printf( "-n <int> to set the number of particles\n" );
         printf( "-p <int> to set the number of threads\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-inc <int> to only move particles that change bin, rebuilding all bins when more than <int>%% of them do\n" );
+        printf( "-tel <name> to publish per-step timings to the telemetry viewer\n" );
+        printf( "-live <name> to stream the positions to \"visualize -live <name>\" while running\n" );
+        printf( "-sym to compute every pair once, for both particles, over a 2x2 checkerboard of bin blocks\n" );
+        printf( "-arena <int> to keep all simulation state in one arena on 0: 4K pages, 1: transparent huge pages, 2: explicit huge pages\n" );
+        printf( "-load <int> to report the bin occupancy and the force time of every thread every <int> steps\n" );
+        printf( "-trace <filename> to write the phases of every thread as a Chrome trace (ui.perfetto.dev)\n" );
+        printf( "-pipe to overlap the rebin with the forces of the next step, without barriers (ignores -inc, -sym, -tel and -load)\n" );
+        printf( "-b <int> to set the number of bin rows per block with -pipe (default: 4, at least k)\n" );
         return 0;
     }
     
     n = read_int( argc, argv, "-n", 1000 );
     n_threads = read_int( argc, argv, "-p", 2 );
     char *savename = read_string( argc, argv, "-o", NULL );
+    seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+    rebuild_percent = read_int( argc, argv, "-inc", 100 );
+    char *telname = read_string( argc, argv, "-tel", NULL );
+    char *livename = read_string( argc, argv, "-live", NULL );
+    int arena_pages = read_int( argc, argv, "-arena", -1 );
+    symmetric = find_option( argc, argv, "-sym" ) >= 0;
+    load_init( &load, read_int( argc, argv, "-load", 0 ), n_threads );
+    char *tracename = read_string( argc, argv, "-trace", NULL );
+    pipelined = find_option( argc, argv, "-pipe" ) >= 0;
+    rows_per_block = max( read_int( argc, argv, "-b", 4 ), k );
     
     //
     //  allocate resources
     //
     fsave = savename ? fopen( savename, "w" ) : NULL;
 
-    particles = (particle_t*) malloc( n * sizeof(particle_t) );
-    set_size( n );
-	globalIds =  (int*) malloc(n * sizeof(int));
-    init_particles( n, particles );
+    set_size( n, k );
+    if( arena_pages >= 0 )
+        init_arena( n, arena_pages );
+    particles = (particle_t*) sim_malloc( n * sizeof(particle_t) );
+	globalIds =  (int*) sim_malloc(n * sizeof(int));
+	if( find_option( argc, argv, "-inc" ) >= 0 && !pipelined )
+		newIds = (int*) sim_malloc(n * sizeof(int));
 
-	bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+	bins = (bin_t*) sim_malloc( num_bins * sizeof(bin_t) );
 	
-	/* make room for up to n particles per bin */
-	for(int i = 0; i < num_bins; i++)
-		bins[i].particle_ids = (int*) malloc( n * sizeof(int));
-
 
 	/* initialise the bins */
     init_bins(bins);
 
-	for(int i = 0; i < n; i++)
-		globalIds[i] = (int)(floor(particles[i].x / cutoff) * num_rows + floor(particles[i].y / cutoff));
-
-	/* insert particles into the bins */
-  	insert_into_bins(particles, bins, 0, n, n);
-
     pthread_attr_t attr;
     P( pthread_attr_init( &attr ) );
     P( pthread_barrier_init( &barrier, NULL, n_threads ) );
@@ -146,21 +421,68 @@ int main( int argc, char **argv )
         thread_ids[i] = i;
 
     pthread_t *threads = (pthread_t *) malloc( n_threads * sizeof( pthread_t ) );
+
+    //
+    //  initialise the particles in parallel
+    //
+    for( int i = 1; i < n_threads; i++ ) 
+        P( pthread_create( &threads[i], &attr, init_routine, &thread_ids[i] ) );
+    
+    init_routine( &thread_ids[0] );
     
+    for( int i = 1; i < n_threads; i++ ) 
+        P( pthread_join( threads[i], NULL ) );
+
+	/* insert particles into the bins */
+  	insert_into_bins(particles, bins, 0, n, n);
+
+	if( pipelined ) {
+		/* the particles start out in bin set 0, and no block has finished a phase */
+		num_blocks = (num_rows + rows_per_block - 1) / rows_per_block;
+		progress = (progress_t*) sim_malloc( num_blocks * sizeof(progress_t) );
+		memset( progress, 0, num_blocks * sizeof(progress_t) );
+		bin_sets[0] = bins;
+		bin_sets[1] = (bin_t*) sim_malloc( num_bins * sizeof(bin_t) );
+		init_bins( bin_sets[1] );
+		leavers = (bin_t*) sim_malloc( num_blocks * sizeof(bin_t) );
+		for( int b = 0; b < num_blocks; b++ )
+		{
+			leavers[b].num_particles = leavers[b].capacity = 0;
+			leavers[b].particle_ids = NULL;
+		}
+	}
+    
+    if( telname && !pipelined )
+        telemetry = telemetry_create( telname, n, n_threads );
+    if( livename )
+        live = live_create( livename, n );
+
+    if( tracename )
+        trace_init( n_threads );
+
     //
     //  do the parallel work
     //
     double simulation_time = read_timer( );
+    void *(*routine)( void* ) = pipelined ? pipeline_routine : thread_routine;
     for( int i = 1; i < n_threads; i++ ) 
-        P( pthread_create( &threads[i], &attr, thread_routine, &thread_ids[i] ) );
+        P( pthread_create( &threads[i], &attr, routine, &thread_ids[i] ) );
     
-    thread_routine( &thread_ids[0] );
+    routine( &thread_ids[0] );
     
     for( int i = 1; i < n_threads; i++ ) 
         P( pthread_join( threads[i], NULL ) );
     simulation_time = read_timer( ) - simulation_time;
+    if( pipelined )
+        bins = bin_sets[NSTEPS % 2];
     
     printf( "n = %d, n_threads = %d, simulation time = %g seconds\n", n, n_threads, simulation_time );
+    printf( "k = %d, pairs within cutoff = %.1f%%\n", k, 100 * pair_hit_rate( particles, bins ) );
+    if( newIds )
+        printf( "particles changing bin per step = %.2f%%\n", 100.0 * movers / ((double)n * NSTEPS) );
+    load_summary( &load );
+    if( tracename )
+        trace_finish( tracename, "pthreads" );
     
     //
     //  release resources
@@ -169,9 +491,19 @@ int main( int argc, char **argv )
     P( pthread_attr_destroy( &attr ) );
     free( thread_ids );
     free( threads );
-    free( particles );
-    free( globalIds );
-    free( bins );
+    sim_free( particles );
+    sim_free( globalIds );
+    sim_free( bins );
+    if( pipelined )
+    {
+        sim_free( bin_sets[(NSTEPS + 1) % 2] );
+        sim_free( progress );
+        sim_free( leavers );
+    }
+    if( telemetry )
+        telemetry_close( telemetry, telname );
+    if( live )
+        live_close( live, livename );
     if( fsave )
         fclose( fsave );
     
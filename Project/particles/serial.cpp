@@ -18,7 +18,9 @@ make -f Makefile_p serial
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 #include "common.h"
+#include "telemetry.h"
 
 extern int num_bins, num_rows; 
 int *globalIds; 
@@ -33,59 +35,120 @@ int main( int argc, char **argv )
         printf( "-h to see this help\n" );
         printf( "-n <int> to set the number of particles\n" );
         printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        printf( "-inc <int> to only move particles that change bin, rebuilding all bins when more than <int>%% of them do\n" );
+        printf( "-hash to keep only the occupied bins, in a hash table\n" );
+        printf( "-tel <name> to publish per-step timings to the telemetry viewer\n" );
+        printf( "-order <int> to sweep the bins in 0: row-major, 1: Z-order, 2: L2-sized tiles (default: 0)\n" );
+        printf( "-live <name> to stream the positions to \"visualize -live <name>\" while running\n" );
+        printf( "-arena <int> to keep all simulation state in one arena on 0: 4K pages, 1: transparent huge pages, 2: explicit huge pages\n" );
         return 0;
     }
     
     int n = read_int( argc, argv, "-n", 1000 );
 
     char *savename = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+    int use_hash = find_option( argc, argv, "-hash" ) >= 0;
+    int rebuild_percent = read_int( argc, argv, "-inc", 100 );
+    char *telname = read_string( argc, argv, "-tel", NULL );
+    char *livename = read_string( argc, argv, "-live", NULL );
+    int order_mode = read_int( argc, argv, "-order", ORDER_ROWS );
+    int arena_pages = read_int( argc, argv, "-arena", -1 );
     
     FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
-    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
-    set_size( n );
-	globalIds =  (int*) malloc(n * sizeof(int));
- 	init_particles( n, particles );
+    set_size( n, k );
+    if( arena_pages >= 0 )
+        init_arena( n, arena_pages );
+    particle_t *particles = (particle_t*) sim_malloc( n * sizeof(particle_t) );
+	globalIds =  (int*) sim_malloc(n * sizeof(int));
+	int *newIds = find_option( argc, argv, "-inc" ) >= 0 && !use_hash ? (int*) sim_malloc(n * sizeof(int)) : NULL;
+	long long movers = 0;
+ 	init_particles( n, particles, seed );
  	
-	bin_t *bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+	bin_t *bins = NULL;
+	hash_grid_t grid;
 	
-	/* make room for up to n particles per bin */
-	for(int i = 0; i < num_bins; i++)
-		bins[i].particle_ids = (int*) malloc(n*sizeof(int));
+	if( use_hash ) {
+		/* memory and sweep cost follow the occupied cells, not the box area */
+		init_hash_grid(&grid, n);
+		insert_into_hash_grid(particles, &grid, n);
+	} else {
+		bins = (bin_t*) sim_malloc( num_bins * sizeof(bin_t) );
 
-	/* initialise the bins */
-    init_bins(bins);
+		/* initialise the bins */
+	    init_bins(bins);
 
-	for(int i = 0; i < n; i++)
-		globalIds[i] = (int)(floor(particles[i].x / cutoff) * num_rows + floor(particles[i].y / cutoff));
+		for(int i = 0; i < n; i++)
+			globalIds[i] = bin_of(particles[i]);
 
-	/* insert particles into the bins */
-  	insert_into_bins(particles, bins, n);
+		/* insert particles into the bins */
+	  	insert_into_bins(particles, bins, n);
+	}
+	int *order = NULL;
+	if( bins && order_mode != ORDER_ROWS ) {
+		order = (int*) sim_malloc( num_bins * sizeof(int) );
+		init_bin_order( order, order_mode, n );
+	}
     
+    telemetry_t *telemetry = telname ? telemetry_create( telname, n, 1 ) : NULL;
+    live_header_t *live = livename ? live_create( livename, n ) : NULL;
+    double marks[NUM_PHASES+1];
+
     //
     //  simulate a number of time steps
     //
     double simulation_time = read_timer( );
     for( int step = 0; step < NSTEPS; step++ )
     {
+        marks[PHASE_FORCE] = read_timer( );
+
         //
         //  compute forces
         //
         for( int i = 0; i < n; i++ )
             particles[i].ax = particles[i].ay = 0;        
         
-        for (int i = 0; i < num_bins; i++)
-			go_through_neighbors(particles, bins, i);
+        if( use_hash ) {
+			for (int i = 0; i < grid.num_cells; i++)
+				go_through_neighbors(particles, &grid, i);
+			marks[PHASE_MOVE] = read_timer( );
+
+			for (int i = 0; i < n; i++)
+				move( particles[i] );
+			marks[PHASE_REBIN] = read_timer( );
+
+			insert_into_hash_grid(particles, &grid, n);
+        } else {
+	        for (int i = 0; i < num_bins; i++)
+				go_through_neighbors(particles, bins, order ? order[i] : i);
+			marks[PHASE_MOVE] = read_timer( );
+
+			move_particles( particles, newIds ? newIds : globalIds, 0, n );
+			marks[PHASE_REBIN] = read_timer( );
+			
+			if( newIds )
+				movers += update_bins(particles, bins, n, newIds, rebuild_percent / 100.0);
+			else
+				insert_into_bins(particles, bins, n);
+        }
+        marks[NUM_PHASES] = read_timer( );
 
-		for (int i = 0; i < n; i++) 
-            move_and_update( particles[i], i, globalIds[i] );		
-		
-		insert_into_bins(particles, bins, n);
+        if( telemetry )
+        	telemetry_publish( telemetry, step, marks, step % SAVEFREQ ? -1 :
+        		use_hash ? max_occupancy( &grid ) : max_occupancy( bins ) );
 
 #ifdef DEBUG
 		/* checking that the number of particles doesnt change */
         int numparticles = 0;
-        for(int i = 0; i < num_bins; i++)
-        	numparticles += bins[i].num_particles;
+        if( use_hash )
+	        for(int i = 0; i < grid.num_cells; i++)
+	        	numparticles += grid.cells[i].num_particles;
+        else
+	        for(int i = 0; i < num_bins; i++)
+	        	numparticles += bins[i].num_particles;
         assert(numparticles==n);
 #endif        
         //
@@ -93,12 +156,24 @@ int main( int argc, char **argv )
         //
         if( fsave && (step%SAVEFREQ) == 0 )
             save( fsave, n, particles );
+        if( live && (step%SAVEFREQ) == 0 )
+            live_publish( live, particles );
     }
     simulation_time = read_timer( ) - simulation_time;
     
     printf( "n = %d, simulation time = %g seconds\n", n, simulation_time );
+    if( use_hash )
+        printf( "k = %d, occupied bins = %d of %lld\n", k, grid.num_cells, (long long)num_rows * num_rows );
+    else
+        printf( "k = %d, pairs within cutoff = %.1f%%\n", k, 100 * pair_hit_rate( particles, bins ) );
+    if( newIds )
+        printf( "particles changing bin per step = %.2f%%\n", 100.0 * movers / ((double)n * NSTEPS) );
     
-    free( particles );
+    sim_free( particles );
+    if( telemetry )
+        telemetry_close( telemetry, telname );
+    if( live )
+        live_close( live, livename );
     if( fsave )
         fclose( fsave );
     
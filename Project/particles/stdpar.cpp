@@ -0,0 +1,175 @@
+/*Particle simulator on the C++17 parallel algorithms.
+
+	Same binned O(n) method as openmp.cpp, but every phase is a standard
+	algorithm with an execution policy, so the threading is left to the
+	library's parallel backend (TBB under libstdc++):
+	 - zeroing, the move and the bin sweep are std::for_each,
+	 - rebinning is a counting sort: an atomic count per bin, then
+	   std::transform_exclusive_scan for the bin offsets, then a scatter
+	   of the particle ids into one shared array.
+	The order of the particles inside a bin depends on thread timing.
+
+To run in Linux:
+make -f Makefile_p stdpar
+./stdpar -p 4
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#include <atomic>
+#include <numeric>
+#include <algorithm>
+#include <execution>
+#if __has_include(<tbb/global_control.h>)
+#include <tbb/global_control.h>
+#define HAVE_TBB
+#endif
+#include "common.h"
+
+extern int num_bins, num_rows;
+int *globalIds;
+
+#define MOVE_CHUNK 4096
+
+//
+//  benchmarking program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-n <int> to set number of particles\n" );
+        printf( "-p <int> to set the number of threads (TBB backend only)\n" );
+        printf( "-o <filename> to specify the output file name\n" );
+        printf( "-s <int> to set the random seed (default: current time)\n" );
+        printf( "-k <int> to use bins of cutoff/k and a (2k+1)^2 stencil (default: 1)\n" );
+        return 0;
+    }
+
+    int n = read_int( argc, argv, "-n", 1000 );
+    int n_threads = read_int( argc, argv, "-p", 0 );
+    char *savename = read_string( argc, argv, "-o", NULL );
+    int seed = read_int( argc, argv, "-s", (int)time( NULL ) );
+    int k = read_int( argc, argv, "-k", 1 );
+
+#ifdef HAVE_TBB
+    tbb::global_control *threads = n_threads > 0 ?
+        new tbb::global_control( tbb::global_control::max_allowed_parallelism, n_threads ) : NULL;
+    n_threads = (int)tbb::global_control::active_value( tbb::global_control::max_allowed_parallelism );
+#endif
+
+    FILE *fsave = savename ? fopen( savename, "w" ) : NULL;
+
+    particle_t *particles = (particle_t*) malloc( n * sizeof(particle_t) );
+    set_size( n, k );
+    globalIds = (int*) malloc( n * sizeof(int) );
+
+    std::vector<int> particle_range( n ), bin_range( num_bins );
+    std::iota( particle_range.begin(), particle_range.end(), 0 );
+    std::iota( bin_range.begin(), bin_range.end(), 0 );
+
+    /* the move runs over contiguous chunks, so that each chunk vectorizes */
+    std::vector<int> chunk_range( (n + MOVE_CHUNK - 1) / MOVE_CHUNK );
+    std::iota( chunk_range.begin(), chunk_range.end(), 0 );
+
+    //
+    //  rebinning state: slot of every particle within its bin, particle
+    //  count and offset of every bin, and the particle ids sorted by bin
+    //
+    std::vector<int> slot( n ), offsets( num_bins ), sorted( n );
+    std::vector<std::atomic<int> > counts( num_bins );
+
+    bin_t *bins = (bin_t*) malloc( num_bins * sizeof(bin_t) );
+    init_bins( bins );
+
+    auto rebin = [&]( )
+    {
+        std::for_each( std::execution::par, counts.begin(), counts.end(),
+            []( std::atomic<int> &c ) { c.store( 0, std::memory_order_relaxed ); } );
+
+        std::for_each( std::execution::par, particle_range.begin(), particle_range.end(),
+            [&]( int i ) { slot[i] = counts[globalIds[i]].fetch_add( 1, std::memory_order_relaxed ); } );
+
+        std::transform_exclusive_scan( std::execution::par, counts.begin(), counts.end(), offsets.begin(), 0,
+            std::plus<int>(), []( const std::atomic<int> &c ) { return c.load( std::memory_order_relaxed ); } );
+
+        std::for_each( std::execution::par_unseq, particle_range.begin(), particle_range.end(),
+            [&]( int i ) { sorted[offsets[globalIds[i]] + slot[i]] = i; } );
+
+        /* the bins point into the shared array instead of owning their ids */
+        std::for_each( std::execution::par_unseq, bin_range.begin(), bin_range.end(),
+            [&]( int b ) {
+                bins[b].num_particles = counts[b].load( std::memory_order_relaxed );
+                bins[b].particle_ids = &sorted[offsets[b]];
+            } );
+    };
+
+    /* every particle is a pure function of (seed, index), so they can be initialised in any order */
+    std::for_each( std::execution::par_unseq, particle_range.begin(), particle_range.end(),
+        [&]( int i ) {
+            init_particles( n, particles + i, seed, i, i + 1 );
+            globalIds[i] = bin_of( particles[i] );
+        } );
+
+    rebin( );
+
+    //
+    //  simulate a number of time steps
+    //
+    double simulation_time = read_timer( );
+
+    for( int step = 0; step < NSTEPS; step++ )
+    {
+        //
+        //  compute all forces
+        //
+        std::for_each( std::execution::par_unseq, particles, particles + n,
+            []( particle_t &p ) { p.ax = p.ay = 0; } );
+
+        std::for_each( std::execution::par_unseq, bin_range.begin(), bin_range.end(),
+            [&]( int b ) { go_through_neighbors( particles, bins, b ); } );
+
+        //
+        //  move particles
+        //
+        std::for_each( std::execution::par, chunk_range.begin(), chunk_range.end(),
+            [&]( int c ) { move_particles( particles, globalIds, c * MOVE_CHUNK, min( (c + 1) * MOVE_CHUNK, n ) ); } );
+
+        rebin( );
+
+#ifdef DEBUG
+        /* checking that the number of particles doesnt change */
+        int numparticles = std::transform_reduce( std::execution::par_unseq, bins, bins + num_bins, 0,
+            std::plus<int>(), []( const bin_t &b ) { return b.num_particles; } );
+        assert( numparticles == n );
+#endif
+
+        //
+        //  save if necessary
+        //
+        if( fsave && (step%SAVEFREQ) == 0 )
+            save( fsave, n, particles );
+    }
+    simulation_time = read_timer( ) - simulation_time;
+
+    printf( "n = %d, n_threads = %d, simulation time = %g seconds\n", n, n_threads, simulation_time );
+    printf( "k = %d, pairs within cutoff = %.1f%%\n", k, 100 * pair_hit_rate( particles, bins ) );
+
+    free( particles );
+    free( globalIds );
+    free( bins );
+#ifdef HAVE_TBB
+    delete threads;
+#endif
+    if( fsave )
+        fclose( fsave );
+
+    return 0;
+}
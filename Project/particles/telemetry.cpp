@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "telemetry.h"
+
+extern double size;
+extern int num_bins, num_rows;
+
+/* shm_open names start with a slash */
+static void segment_name( char *segment, const char *name ) {
+	snprintf( segment, 256, "/%s", name );
+}
+
+/* create the segment of a run; an old one of the same name is replaced */
+telemetry_t *telemetry_create( const char *name, int n, int num_threads ) {
+	char segment[256];
+	segment_name( segment, name );
+	shm_unlink( segment );
+
+	int fd = shm_open( segment, O_CREAT | O_RDWR, 0644 );
+	if (fd < 0 || ftruncate( fd, sizeof(telemetry_t) ) != 0) {
+		printf( "cannot create the telemetry segment %s\n", segment );
+		return NULL;
+	}
+	telemetry_t *t = (telemetry_t*) mmap( NULL, sizeof(telemetry_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if (t == MAP_FAILED)
+		return NULL;
+
+	/* ftruncate zero fills, so head, finished and the records start at 0 */
+	t->n = n;
+	t->num_bins = num_rows * num_rows;		/* without the padding */
+	t->num_threads = num_threads;
+	t->max_occupancy = -1;
+	memcpy( t->magic, TELEMETRY_MAGIC, sizeof(TELEMETRY_MAGIC) );
+	return t;
+}
+
+telemetry_t *telemetry_attach( const char *name ) {
+	char segment[256];
+	segment_name( segment, name );
+
+	int fd = shm_open( segment, O_RDONLY, 0 );
+	if (fd < 0)
+		return NULL;
+	telemetry_t *t = (telemetry_t*) mmap( NULL, sizeof(telemetry_t), PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if (t == MAP_FAILED || memcmp( t->magic, TELEMETRY_MAGIC, sizeof(TELEMETRY_MAGIC) ) != 0)
+		return NULL;
+	return t;
+}
+
+/* marks are the time at the start of the step and at the end of every
+   phase; max_occupancy is -1 on the steps where it was not sampled */
+void telemetry_publish( telemetry_t *t, int step, double *marks, int max_occupancy ) {
+	long long head = t->head;
+	if (head == 0)
+		t->start = marks[0];
+	if (max_occupancy >= 0)
+		t->max_occupancy = max_occupancy;
+
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	telemetry_record_t *r = &t->records[head % TELEMETRY_SLOTS];
+	r->step = step;
+	r->max_occupancy = t->max_occupancy;
+	r->elapsed = marks[NUM_PHASES] - t->start;
+	for (int p = 0; p < NUM_PHASES; p++)
+		r->phase[p] = marks[p+1] - marks[p];
+
+	__atomic_store_n( &t->head, head + 1, __ATOMIC_RELEASE );
+}
+
+long long telemetry_head( telemetry_t *t ) {
+	return __atomic_load_n( &t->head, __ATOMIC_ACQUIRE );
+}
+
+/* copy record i, returns 0 if it was overwritten before or during the copy */
+int telemetry_read( telemetry_t *t, long long i, telemetry_record_t *r ) {
+	if (i >= telemetry_head( t ))
+		return 0;
+	memcpy( r, &t->records[i % TELEMETRY_SLOTS], sizeof(telemetry_record_t) );
+	__atomic_thread_fence( __ATOMIC_ACQUIRE );
+	return telemetry_head( t ) < i + TELEMETRY_SLOTS;
+}
+
+/* mark the run as finished and remove the name; attached viewers keep their mapping */
+void telemetry_close( telemetry_t *t, const char *name ) {
+	char segment[256];
+	segment_name( segment, name );
+
+	__atomic_store_n( &t->finished, 1, __ATOMIC_RELEASE );
+	munmap( t, sizeof(telemetry_t) );
+	shm_unlink( segment );
+}
+
+static size_t live_bytes( int n ) {
+	return sizeof(live_header_t) + 2 * (size_t)n * 2 * sizeof(float);
+}
+
+live_header_t *live_create( const char *name, int n ) {
+	char segment[256];
+	segment_name( segment, name );
+	shm_unlink( segment );
+
+	int fd = shm_open( segment, O_CREAT | O_RDWR, 0644 );
+	if (fd < 0 || ftruncate( fd, live_bytes( n ) ) != 0) {
+		printf( "cannot create the live segment %s\n", segment );
+		return NULL;
+	}
+	live_header_t *live = (live_header_t*) mmap( NULL, live_bytes( n ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if (live == MAP_FAILED)
+		return NULL;
+
+	live->n = n;
+	live->size = size;
+	live->sequence = -1;
+	memcpy( live->magic, LIVE_MAGIC, sizeof(LIVE_MAGIC) );
+	return live;
+}
+
+/* write the next frame into the buffer that readers are not told about yet */
+void live_publish( live_header_t *live, particle_t *particles ) {
+	long long s = live->sequence + 1;
+	/* keep the buffer writes after the publication of the previous frame */
+	__atomic_thread_fence( __ATOMIC_RELEASE );
+	float *xy = (float*) (live + 1) + (s % 2) * 2 * (size_t)live->n;
+	for (int i = 0; i < live->n; i++) {
+		xy[2*i] = (float) particles[i].x;
+		xy[2*i+1] = (float) particles[i].y;
+	}
+	__atomic_store_n( &live->sequence, s, __ATOMIC_RELEASE );
+}
+
+void live_close( live_header_t *live, const char *name ) {
+	char segment[256];
+	segment_name( segment, name );
+
+	__atomic_store_n( &live->finished, 1, __ATOMIC_RELEASE );
+	munmap( live, live_bytes( live->n ) );
+	shm_unlink( segment );
+}
+
+int max_occupancy( bin_t *bins ) {
+	int most = 0;
+	for (int i = 0; i < num_bins; i++)
+		most = max( most, bins[i].num_particles );
+	return most;
+}
+
+int max_occupancy( hash_grid_t *grid ) {
+	int most = 0;
+	for (int i = 0; i < grid->num_cells; i++)
+		most = max( most, grid->cells[i].num_particles );
+	return most;
+}
+
+#define LOAD_BUCKETS 16			/* bucket b > 0 holds the bins of 2^(b-1) .. 2^b - 1 particles */
+
+void load_init( load_t *load, int every, int num_threads ) {
+	load->every = every;
+	load->num_threads = num_threads;
+	load->busy = (double*) calloc( num_threads, sizeof(double) );
+	load->samples = 0;
+	load->bin_imbalance = load->thread_imbalance = 0;
+}
+
+int load_sampled( load_t *load, int step ) {
+	return load->every > 0 && step % load->every == 0;
+}
+
+static void add_to_histogram( int *histogram, int particles ) {
+	int b = 0;
+	while (particles >> b && b < LOAD_BUCKETS - 1)
+		b++;
+	histogram[b]++;
+}
+
+/* n particles in cells bins, the fullest holding most */
+static void report( load_t *load, int step, int *histogram, int most, double cells, int n ) {
+	double mean = (double)n / cells;
+	printf( "# load %d: fullest bin %d = %.2fx mean, bins by particles", step, most, most / mean );
+	for (int b = 0; b < LOAD_BUCKETS; b++) {
+		if (!histogram[b])
+			continue;
+		if (b < 2)
+			printf( " %d:%d", b, histogram[b] );
+		else
+			printf( " %d-%d:%d", 1 << (b-1), (1 << b) - 1, histogram[b] );
+	}
+	printf( "\n" );
+
+	double slowest = 0, total = 0;
+	for (int t = 0; t < load->num_threads; t++) {
+		slowest = fmax( slowest, load->busy[t] );
+		total += load->busy[t];
+	}
+	double busy_mean = total / load->num_threads;
+	printf( "# load %d: slowest thread %.3f ms = %.2fx mean, waiting %.3f ms in all, threads (ms)", step,
+		1e3 * slowest, busy_mean > 0 ? slowest / busy_mean : 1, 1e3 * (load->num_threads * slowest - total) );
+	for (int t = 0; t < load->num_threads; t++)
+		printf( " %.3f", 1e3 * load->busy[t] );
+	printf( "\n" );
+
+	load->samples++;
+	load->bin_imbalance += most / mean;
+	load->thread_imbalance += busy_mean > 0 ? slowest / busy_mean : 1;
+	for (int t = 0; t < load->num_threads; t++)
+		load->busy[t] = 0;
+}
+
+void load_report( load_t *load, int step, bin_t *bins ) {
+	int histogram[LOAD_BUCKETS] = { 0 }, most = 0, n = 0;
+	for (int i = 0; i < num_bins; i++) {
+		add_to_histogram( histogram, bins[i].num_particles );
+		most = max( most, bins[i].num_particles );
+		n += bins[i].num_particles;
+	}
+	histogram[0] -= num_bins - num_rows * num_rows;		/* the padding is always empty */
+	report( load, step, histogram, most, (double)num_rows * num_rows, n );
+}
+
+/* the empty cells are not stored, nor listed; they count in the mean as bins would */
+void load_report( load_t *load, int step, hash_grid_t *grid ) {
+	int histogram[LOAD_BUCKETS] = { 0 }, most = 0, n = 0;
+	for (int i = 0; i < grid->num_cells; i++) {
+		add_to_histogram( histogram, grid->cells[i].num_particles );
+		most = max( most, grid->cells[i].num_particles );
+		n += grid->cells[i].num_particles;
+	}
+	report( load, step, histogram, most, (double)num_rows * num_rows, n );
+}
+
+void load_summary( load_t *load ) {
+	if (load->samples)
+		printf( "load over %d samples: fullest bin %.2fx mean, slowest thread %.2fx mean\n", load->samples,
+			load->bin_imbalance / load->samples, load->thread_imbalance / load->samples );
+	free( load->busy );
+}
@@ -0,0 +1,102 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include "common.h"
+
+//
+//  live telemetry: a driver run with "-tel <name>" publishes one record
+//  per step into the POSIX shared memory segment /<name>, which the
+//  telemetry viewer reads while the run is going on
+//
+#define TELEMETRY_MAGIC "PARTTEL"
+#define TELEMETRY_SLOTS 4096
+
+/* the phases of a step, timed by the driver */
+#define PHASE_FORCE 0
+#define PHASE_MOVE  1
+#define PHASE_REBIN 2
+#define NUM_PHASES  3
+
+typedef struct{
+	int step;
+	int max_occupancy;			/* particles in the fullest bin, last sampled every SAVEFREQ steps */
+	double elapsed;				/* seconds since the start of the first step */
+	double phase[NUM_PHASES];	/* seconds spent in every phase of this step */
+} telemetry_record_t;
+
+//
+//  single writer, any number of readers, no locks: the writer fills
+//  slot head % TELEMETRY_SLOTS and then publishes it by incrementing
+//  head. A reader copies record i and then checks that head has not
+//  moved TELEMETRY_SLOTS past it, which means the copy was overwritten
+//
+typedef struct{
+	char magic[8];				/* TELEMETRY_MAGIC */
+	int n;
+	int num_bins;
+	int num_threads;
+	int finished;				/* set when the run is over */
+	long long head;				/* number of records published */
+	double start;
+	int max_occupancy;
+	telemetry_record_t records[TELEMETRY_SLOTS];
+} telemetry_t;
+
+telemetry_t *telemetry_create( const char *name, int n, int num_threads );
+telemetry_t *telemetry_attach( const char *name );
+void telemetry_publish( telemetry_t *t, int step, double *marks, int max_occupancy );
+int telemetry_read( telemetry_t *t, long long i, telemetry_record_t *r );
+long long telemetry_head( telemetry_t *t );
+void telemetry_close( telemetry_t *t, const char *name );
+
+//
+//  live frames: a driver run with "-live <name>" publishes the positions
+//  every SAVEFREQ steps into the segment /<name>, and "visualize -live
+//  <name>" draws the latest one. The header is followed by two buffers
+//  of n (x,y) floats. Frame s goes to buffer s % 2 and is published by
+//  setting sequence to s, so the writer never waits. A reader copies
+//  buffer sequence % 2 and keeps the copy only if sequence did not
+//  change meanwhile (the next frame goes to the other buffer, the one
+//  after it would overwrite the copy)
+//
+#define LIVE_MAGIC "PARTLIV"
+
+typedef struct{
+	char magic[8];				/* LIVE_MAGIC */
+	int n;
+	int finished;				/* set when the run is over */
+	double size;
+	long long sequence;			/* last frame published, -1 before the first */
+} live_header_t;
+
+live_header_t *live_create( const char *name, int n );
+void live_publish( live_header_t *live, particle_t *particles );
+void live_close( live_header_t *live, const char *name );
+
+int max_occupancy( bin_t *bins );
+int max_occupancy( hash_grid_t *grid );
+
+//
+//  load report: a threaded driver run with "-load <K>" samples, every K
+//  steps, how many particles the bins hold and how long every thread
+//  computed forces, and prints the fullest bin and the slowest thread
+//  against the mean. The threads add their force time to busy[thread]
+//  on the sampled steps; the report clears it. What a thread waits at
+//  the barrier that ends the force phase is the slowest time minus its own
+//
+typedef struct{
+	int every;					/* steps between samples, 0 if off */
+	int num_threads;
+	double *busy;				/* force time of every thread in the sampled step */
+	int samples;
+	double bin_imbalance;		/* sums of max / mean over the samples */
+	double thread_imbalance;
+} load_t;
+
+void load_init( load_t *load, int every, int num_threads );
+int load_sampled( load_t *load, int step );
+void load_report( load_t *load, int step, bin_t *bins );
+void load_report( load_t *load, int step, hash_grid_t *grid );
+void load_summary( load_t *load );
+
+#endif
@@ -0,0 +1,113 @@
+/*Live view of a running simulation.
+
+	Attaches to the telemetry segment of a driver started with
+	"-tel <name>" and prints, every interval, the step rate, the mean
+	time of every phase and the fill of the fullest bin against the
+	mean over all bins. With -dump it prints every record instead. It
+	only reads the segment, so the run does not notice the viewer, and
+	it stops when the run finishes.
+
+To run in Linux:
+make -f Makefile_p telemetry
+./serial -n 100000 -tel particles &
+./telemetry -tel particles
+
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "telemetry.h"
+
+int *globalIds;				/* only used by the simulators */
+
+//
+//  viewer program
+//
+int main( int argc, char **argv )
+{
+    if( find_option( argc, argv, "-h" ) >= 0 )
+    {
+        printf( "Options:\n" );
+        printf( "-h to see this help\n" );
+        printf( "-tel <name> to set the telemetry name of the run (default: particles)\n" );
+        printf( "-i <int> to set the refresh interval in milliseconds (default: 500)\n" );
+        printf( "-dump to print every record instead of a summary per interval\n" );
+        return 0;
+    }
+
+    char *name = read_string( argc, argv, "-tel", (char*)"particles" );
+    int interval = read_int( argc, argv, "-i", 500 );
+    int dump = find_option( argc, argv, "-dump" ) >= 0;
+
+    /* the run may not have started yet */
+    telemetry_t *t = NULL;
+    for( int tries = 0; !t && tries < 100; tries++ )
+        if( !(t = telemetry_attach( name )) )
+            usleep( 100000 );
+    if( !t )
+    {
+        printf( "no telemetry segment /%s\n", name );
+        return 2;
+    }
+
+    double mean_occupancy = (double)t->n / t->num_bins;
+    printf( "# n = %d, threads = %d, bins = %d, mean particles per bin = %.3f\n", t->n, t->num_threads, t->num_bins, mean_occupancy );
+    if( dump )
+        printf( "# step  elapsed (s)  force (ms)  move (ms)  rebin (ms)  fullest bin\n" );
+    else
+        printf( "# step  steps/s  force (ms)  move (ms)  rebin (ms)  fullest bin / mean\n" );
+
+    long long next = 0, dropped = 0;
+    double last_elapsed = 0;
+    for( ;; )
+    {
+        int finished = __atomic_load_n( &t->finished, __ATOMIC_ACQUIRE );
+        long long head = telemetry_head( t );
+
+        /* skip whatever the writer already overwrote */
+        if( head - next > TELEMETRY_SLOTS )
+        {
+            dropped += head - TELEMETRY_SLOTS - next;
+            next = head - TELEMETRY_SLOTS;
+        }
+
+        int count = 0;
+        double phase[NUM_PHASES] = { 0 };
+        /* a failed read leaves a torn record in r, so the summary uses the last good one */
+        telemetry_record_t r, last;
+        for( ; next < head; next++ )
+        {
+            if( !telemetry_read( t, next, &r ) )
+            {
+                dropped++;
+                continue;
+            }
+            last = r;
+            if( dump )
+                printf( "%6d  %11.4f  %10.3f  %9.3f  %10.3f  %11d\n", r.step, r.elapsed,
+                    1e3 * r.phase[PHASE_FORCE], 1e3 * r.phase[PHASE_MOVE], 1e3 * r.phase[PHASE_REBIN], r.max_occupancy );
+            for( int p = 0; p < NUM_PHASES; p++ )
+                phase[p] += r.phase[p];
+            count++;
+        }
+
+        if( !dump && count > 0 )
+        {
+            printf( "%6d  %7.1f  %10.3f  %9.3f  %10.3f  %11.2f\n", last.step, count / (last.elapsed - last_elapsed),
+                1e3 * phase[PHASE_FORCE] / count, 1e3 * phase[PHASE_MOVE] / count, 1e3 * phase[PHASE_REBIN] / count,
+                last.max_occupancy / mean_occupancy );
+            last_elapsed = last.elapsed;
+        }
+        fflush( stdout );
+
+        if( finished )
+            break;
+        usleep( interval * 1000 );
+    }
+
+    if( dropped )
+        printf( "# %lld records were overwritten before they were read\n", dropped );
+
+    return 0;
+}
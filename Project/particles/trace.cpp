@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "common.h"
+#include "trace.h"
+
+/* one per thread, a cache line each, so that threads do not share the counters */
+typedef struct{
+	int count;
+	int capacity;
+	trace_event_t *events;
+	char pad[64 - 2 * sizeof(int) - sizeof(trace_event_t*)];
+} trace_buffer_t;
+
+static trace_buffer_t *buffers;		/* NULL when not tracing */
+static int num_buffers;
+static double origin;
+
+void trace_init( int num_threads ) {
+	num_buffers = num_threads;
+	buffers = (trace_buffer_t*) calloc( num_threads, sizeof(trace_buffer_t) );
+	origin = read_timer( );
+}
+
+void trace_begin( int thread, const char *name ) {
+	if (!buffers)
+		return;
+	trace_buffer_t *b = &buffers[thread];
+	if (b->count == b->capacity) {
+		b->capacity = b->capacity ? 2 * b->capacity : 1024;
+		b->events = (trace_event_t*) realloc( b->events, b->capacity * sizeof(trace_event_t) );
+	}
+	trace_event_t *e = &b->events[b->count++];
+	e->name = name;
+	e->begin = e->end = read_timer( ) - origin;
+}
+
+/* ends the last phase the thread began */
+void trace_end( int thread ) {
+	if (!buffers)
+		return;
+	trace_buffer_t *b = &buffers[thread];
+	b->events[b->count-1].end = read_timer( ) - origin;
+}
+
+//
+//  the events of this process as a list of complete ("X") events in
+//  microseconds, every one preceded by a comma, so that the lists of
+//  several processes can be concatenated. Returns the length
+//
+int trace_format( char **json, int pid, const char *process ) {
+	if (!buffers) {
+		*json = NULL;
+		return 0;
+	}
+	size_t events = 0;
+	for (int t = 0; t < num_buffers; t++)
+		events += buffers[t].count;
+
+	size_t capacity = (events + num_buffers + 1) * 128 + 1, length = 0;
+	char *out = (char*) malloc( capacity );
+	length += sprintf( out + length, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}", pid, process );
+	for (int t = 0; t < num_buffers; t++) {
+		length += sprintf( out + length, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", pid, t, t );
+		for (int i = 0; i < buffers[t].count; i++) {
+			trace_event_t *e = &buffers[t].events[i];
+			length += sprintf( out + length, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f}",
+				e->name, pid, t, 1e6 * e->begin, 1e6 * (e->end - e->begin) );
+		}
+	}
+	*json = out;
+	return (int)length;
+}
+
+/* json is what trace_format returned, of one or more processes */
+void trace_write( const char *filename, char *json, int length ) {
+	FILE *f = fopen( filename, "w" );
+	if (!f) {
+		printf( "cannot open %s\n", filename );
+		return;
+	}
+	fprintf( f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" );
+	if (length > 0)
+		fwrite( json + 1, 1, length - 1, f );
+	fprintf( f, "\n]}\n" );
+	fclose( f );
+}
+
+/* stop tracing and drop the events */
+void trace_free( ) {
+	if (!buffers)
+		return;
+	for (int t = 0; t < num_buffers; t++)
+		free( buffers[t].events );
+	free( buffers );
+	buffers = NULL;
+}
+
+/* write the events of a single process, then stop tracing */
+void trace_finish( const char *filename, const char *process ) {
+	if (!buffers)
+		return;
+	char *json;
+	int length = trace_format( &json, 0, process );
+	trace_write( filename, json, length );
+	free( json );
+	trace_free( );
+}
@@ -0,0 +1,25 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+//
+//  event trace: a threaded driver run with "-trace <file>" records when
+//  every thread begins and ends every phase of every step, into one
+//  buffer per thread, and writes them at exit as Chrome trace-event JSON
+//  (open it in ui.perfetto.dev or chrome://tracing). Barrier waits are
+//  recorded as phases too, so stragglers and the serial rebin stand out.
+//  Without -trace, trace_begin and trace_end return at once.
+//
+typedef struct{
+	const char *name;			/* a string literal, not copied */
+	double begin, end;			/* seconds since trace_init */
+} trace_event_t;
+
+void trace_init( int num_threads );
+void trace_begin( int thread, const char *name );
+void trace_end( int thread );
+int trace_format( char **json, int pid, const char *process );
+void trace_write( const char *filename, char *json, int length );
+void trace_free( );
+void trace_finish( const char *filename, const char *process );
+
+#endif
@@ -3,14 +3,19 @@
 To run in Linux:
 make -f Makefile_v
 ./visualize [input file]
+./visualize -live <name>	(a running "serial -live <name>", see telemetry.h)
 
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>    
+#include <string.h>
 #include <vector>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <SDL/SDL.h>
 #include <SDL/SDL_opengl.h>
 #include <GL/glu.h>
@@ -23,6 +28,57 @@ make -f Makefile_v
 #define MIN_SIZE 100
 
 struct particle_t { float x, y; };
+
+/* same layout as trajectory_header_t in common.h */
+#define TRAJECTORY_MAGIC "PARTTRJ"
+struct binary_header_t { char magic[8]; int n; int reserved; double size; };
+
+/* same layout as live_header_t in telemetry.h, followed by two frames of n (x,y) floats */
+#define LIVE_MAGIC "PARTLIV"
+struct live_header_t { char magic[8]; int n; int finished; double size; long long sequence; };
+
+//
+//  map the live segment of a running simulation, NULL if there is none
+//
+live_header_t *attach_live( const char *name )
+{
+    char segment[256];
+    snprintf( segment, sizeof(segment), "/%s", name );
+    int fd = shm_open( segment, O_RDONLY, 0 );
+    if( fd < 0 )
+        return NULL;
+
+    live_header_t header;
+    if( read( fd, &header, sizeof(header) ) != sizeof(header) || strcmp( header.magic, LIVE_MAGIC ) != 0 )
+    {
+        close( fd );
+        return NULL;
+    }
+    size_t bytes = sizeof(header) + 2 * (size_t)header.n * sizeof(particle_t);
+    void *live = mmap( NULL, bytes, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    return live == MAP_FAILED ? NULL : (live_header_t*) live;
+}
+
+//
+//  replace frame by the latest one if it is newer than shown. The copy goes
+//  to scratch first and is dropped if the frame changed during the copy,
+//  so frame never holds a torn one; false if frame was not replaced
+//
+bool read_live( live_header_t *live, long long &shown, std::vector<particle_t> &scratch, std::vector<particle_t> &frame )
+{
+    long long s = __atomic_load_n( &live->sequence, __ATOMIC_ACQUIRE );
+    if( s < 0 || s == shown )
+        return false;
+    particle_t *latest = (particle_t*)(live + 1) + (s % 2) * live->n;
+    memcpy( &scratch[0], latest, live->n * sizeof(particle_t) );
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    if( __atomic_load_n( &live->sequence, __ATOMIC_RELAXED ) != s )
+        return false;
+    frame.swap( scratch );
+    shown = s;
+    return true;
+}
 	
 double read_timer( )
 {
@@ -61,26 +117,70 @@ void make_surface( int sx, int sy )
     glLoadIdentity();  
 }
 
-int main( int argc, char *argv[] )
+//
+//  read a whole binary trajectory (trajectory_header_t in common.h) or text one
+//
+bool read_trajectory( const char *filename, int &n, float &size, std::vector<particle_t> &particles )
 {
-    const char *filename = argc > 1 ? argv[1] : DEFAULT_FILENAME;
-	
-    FILE *f = fopen( filename, "r" );
+    FILE *f = fopen( filename, "rb" );
     if( f == NULL )
     {
         printf( "failed to find %s\n", filename );
-        return 1;
+        return false;
     }
-    
+
+    particle_t p;
+    binary_header_t header;
+    if( fread( &header, sizeof(header), 1, f ) == 1 && strcmp( header.magic, TRAJECTORY_MAGIC ) == 0 )
+    {
+        n = header.n;
+        size = (float)header.size;
+        double xy[2];
+        while( fread( xy, sizeof(xy), 1, f ) == 1 )
+        {
+            p.x = (float)xy[0];
+            p.y = (float)xy[1];
+            particles.push_back( p );
+        }
+    }
+    else
+    {
+        rewind( f );
+        fscanf( f, "%d%g", &n, &size );
+        while( fscanf( f, "%g%g", &p.x, &p.y ) == 2 )
+            particles.push_back( p );
+    }
+    fclose( f );
+    return true;
+}
+
+int main( int argc, char *argv[] )
+{
     int n;
     float size;
-    fscanf( f, "%d%g", &n, &size );
-	
-    particle_t p;
     std::vector<particle_t> particles;
-    while( fscanf( f, "%g%g", &p.x, &p.y ) == 2 )
-        particles.push_back( p );
-    fclose( f );
+    std::vector<particle_t> incoming;		/* a live frame while it is copied */
+
+    //
+    //  live frames from a running simulation: one frame, replaced as new ones arrive
+    //
+    live_header_t *live = NULL;
+    long long shown = -1;
+    if( argc > 2 && strcmp( argv[1], "-live" ) == 0 )
+    {
+        live = attach_live( argv[2] );
+        if( live == NULL )
+        {
+            printf( "no live simulation named %s\n", argv[2] );
+            return 1;
+        }
+        n = live->n;
+        size = (float)live->size;
+        particles.resize( n );
+        incoming.resize( n );
+    }
+    else if( !read_trajectory( argc > 1 ? argv[1] : DEFAULT_FILENAME, n, size, particles ) )
+        return 1;
 	
     int nframes = particles.size( ) / n;
     if( nframes == 0 )
@@ -126,6 +226,8 @@ int main( int argc, char *argv[] )
         glVertex2d( 0, size );
         glEnd( );
 		
+        if( live )
+            read_live( live, shown, incoming, particles );
         int iframe = (int)(read_timer()*FPS) % nframes;
         particle_t *p = &particles[iframe*n];
 		